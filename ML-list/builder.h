@@ -13,13 +13,17 @@
 template <class KeyType>
 class Builder {
  public:
+  // With `eytzinger_layout`, the spline also keeps its keys in Eytzinger
+  // order, see `RadixSpline`, which pays off for large splines with few
+  // radix bits.
   Builder(KeyType min_key, KeyType max_key, size_t num_radix_bits = 18,
-          size_t max_error = 32)
+          size_t max_error = 32, bool eytzinger_layout = false)
       : min_key_(min_key),
         max_key_(max_key),
         num_radix_bits_(num_radix_bits),
         num_shift_bits_(GetNumShiftBits(max_key - min_key, num_radix_bits)),
         max_error_(max_error),
+        eytzinger_layout_(eytzinger_layout),
         curr_num_keys_(0),
         curr_num_distinct_keys_(0),
         prev_key_(min_key),
@@ -54,7 +58,8 @@ class Builder {
 
     return new RadixSpline<KeyType>(
         min_key_, max_key_, curr_num_keys_, num_radix_bits_, num_shift_bits_,
-        max_error_, std::move(radix_table_), std::move(spline_points_));
+        max_error_, std::move(radix_table_), std::move(spline_points_),
+        eytzinger_layout_);
   }
 
  private:
@@ -226,6 +231,7 @@ class Builder {
   const size_t num_radix_bits_;
   const size_t num_shift_bits_;
   const size_t max_error_;
+  const bool eytzinger_layout_;
 
   std::vector<uint32_t> radix_table_;
   std::vector<Coord<KeyType>> spline_points_;
@@ -22,6 +22,7 @@
  */
 
 #include "list.h"	
+#include "builder.h"
 
 
 /*
@@ -88,6 +89,42 @@ void sl_set_delete(sl_intset_t *set)
   free(set);
 }
 
+/*
+ * Build a set holding the keys of a sorted array by appending them in order,
+ * in time linear in n, and train the spline in the same pass. Duplicate keys
+ * are skipped. *spline is NULL if there are fewer than two distinct keys.
+ */
+sl_intset_t *sl_set_bulk_load(const val_t *keys, size_t n, RadixSpline<val_t> **spline)
+{
+  sl_intset_t *set;
+  sl_node_t *pred, *tail;
+  Builder<val_t> *builder = NULL;
+  size_t i;
+
+  set = sl_set_new();
+  pred = set->head;
+  tail = pred->next;
+  if (n >= 2 && keys[0] < keys[n-1])
+    builder = new Builder<val_t>(keys[0], keys[n-1], SPLINE_RADIX_BITS,
+                                 SPLINE_MAX_ERROR, SPLINE_LAYOUT);
+  for (i = 0; i < n; i++) {
+    if (pred != set->head && keys[i] == pred->val)
+      continue;
+    assert(pred == set->head || pred->val < keys[i]);
+    pred->next = sl_new_node(keys[i], tail, 0);
+    pred = pred->next;
+    if (builder != NULL)
+      builder->AddKey(keys[i]);
+  }
+
+  *spline = NULL;
+  if (builder != NULL) {
+    *spline = builder->Finalize();
+    delete builder;
+  }
+  return set;
+}
+
 unsigned long sl_set_size(sl_intset_t *set)
 {
   unsigned long size = 0;
@@ -95,65 +132,124 @@ unsigned long sl_set_size(sl_intset_t *set)
 
   node = set->head->next;
   while (node->next != NULL) {
-    size++;
+    if (!node->deleted)
+      size++;
     node = node->next;
   }
 
   return size;
 }
 
-shift_node_t *new_shift_table(int table_size) {
-  shift_node_t *shift_table = (shift_node_t *) malloc((table_size) * sizeof(shift_node_t));
-  for (int i = 0; i < table_size; i++) {
-    shift_table[i].count = 0;
-    shift_table[i].delta = INT_MAX;
-    shift_table[i].node = NULL;
+/*
+ * Whether node holds val. The tail stores VAL_MAX, which may also be a key,
+ * so a match there also requires a successor.
+ */
+static inline int sl_match(sl_node_t *node, val_t val) {
+  return node->val == val && (val != VAL_MAX || node->next != NULL);
+}
+
+shift_group_t *new_shift_table(size_t table_size) {
+  size_t nb_groups = (table_size + SHIFT_GROUP - 1) / SHIFT_GROUP;
+  shift_group_t *shift_table;
+
+  if (posix_memalign((void **)&shift_table, 64, nb_groups * sizeof(shift_group_t)) != 0) {
+    fprintf(stderr, "Error allocating the shift table\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < nb_groups * SHIFT_GROUP; i++) {
+    SHIFT_KEY(shift_table, i) = VAL_MAX;
+    SHIFT_NODE(shift_table, i) = NULL;
+    SHIFT_COUNT(shift_table, i) = 0;
+    SHIFT_DELTA(shift_table, i) = INT32_MAX;
   }
   return shift_table;
 }
 
-void populate_shift_table(sl_intset_t *set, shift_node_t *shift_table, RadixSpline<val_t> *spline, int table_size) {
+/*
+ * Bucket of val: its estimated position, scaled to the table. The spline
+ * computes it in fixed point, once trained for table_size buckets.
+ */
+static inline long shift_bucket(RadixSpline<val_t> *spline, val_t val, size_t table_size) {
+  assert(spline->GetNumBuckets() == table_size);
+  return (long)spline->GetBucket(val);
+}
+
+void populate_shift_table(sl_intset_t *set, shift_group_t *shift_table, RadixSpline<val_t> *spline, size_t table_size) {
   sl_node_t *node = set->head;
-  int j = 0;
+  size_t j = 0;
+  long i;
   while (node->next->next != NULL) {
     node = node->next;
-    int k = spline->GetEstimatedPosition(node->val) * (table_size-1);
-    int delta = j - k;
-    if (delta <= shift_table[k].delta) {
-      shift_table[k].delta = delta;
-      shift_table[k].node = node;
+    long k = shift_bucket(spline, node->val, table_size);
+    /*
+     * Keys arrive in order, so the first one is the entry point of the
+     * bucket. Counts and deltas saturate at 32 bits, so they take 8 of the
+     * 24 bytes of an entry even on sets of billions of keys.
+     */
+    if (SHIFT_COUNT(shift_table, k) == 0) {
+      int64_t delta = (int64_t)j - k;
+      SHIFT_DELTA(shift_table, k) = (delta > INT32_MAX) ? INT32_MAX : (delta < INT32_MIN) ? INT32_MIN : (int32_t)delta;
+      SHIFT_KEY(shift_table, k) = node->val;
+      SHIFT_NODE(shift_table, k) = node;
     }
-    shift_table[k].count++;
+    if (SHIFT_COUNT(shift_table, k) != UINT32_MAX)
+      SHIFT_COUNT(shift_table, k)++;
     j++;
   }
 
 
-  for (j = table_size-1; j >= 0; j--) {
-    if (shift_table[j].count == 0) {
-      shift_table[j].count = shift_table[j+1].count;
-      shift_table[j].delta = shift_table[j+1].delta+1;
-      shift_table[j].node = shift_table[j+1].node;
+  /*
+   * Point every empty bucket to the previous non-empty one, and the first
+   * one to the head if no key maps there. Buckets follow the order of keys,
+   * so the entry of any bucket before the one of a key is below that key:
+   * the scan for a predecessor in shift_table_pred() steps back at most
+   * once, and only falls back to the head for keys not above the entry of
+   * the first bucket.
+   */
+  if (SHIFT_COUNT(shift_table, 0) == 0) {
+    SHIFT_COUNT(shift_table, 0) = 1;
+    SHIFT_DELTA(shift_table, 0) = 0;
+    SHIFT_KEY(shift_table, 0) = set->head->val;
+    SHIFT_NODE(shift_table, 0) = set->head;
+  }
+  for (i = 1; i < (long)table_size; i++) {
+    if (SHIFT_COUNT(shift_table, i) == 0) {
+      SHIFT_COUNT(shift_table, i) = SHIFT_COUNT(shift_table, i-1);
+      SHIFT_DELTA(shift_table, i) = SHIFT_DELTA(shift_table, i-1) - (SHIFT_DELTA(shift_table, i-1) != INT32_MIN);
+      SHIFT_KEY(shift_table, i) = SHIFT_KEY(shift_table, i-1);
+      SHIFT_NODE(shift_table, i) = SHIFT_NODE(shift_table, i-1);
     }
   }
 }
 
-int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations)
+/*
+ * Node to start a search for val from: the entry of k, the bucket of val, or
+ * of the bucket before, whichever is below val first, else the head, as for
+ * keys below the first entry. Nodes are never unlinked, so it stays a
+ * predecessor of val, and the search never skips a node holding val.
+ */
+static inline sl_node_t *shift_table_pred(sl_intset_t *set, shift_group_t *shift_table, long k, val_t val) {
+  /* Check the inline keys, then read the one node we start from */
+  if (SHIFT_KEY(shift_table, k) >= val)
+    k--;
+  if (k >= 0 && SHIFT_KEY(shift_table, k) >= val)
+    k = -1;
+  return (k >= 0) ? SHIFT_NODE(shift_table, k) : set->head;
+}
+
+int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations)
 {
 	int result = 0;
 	sl_node_t *node;
 	
-	int k = spline->GetEstimatedPosition(val) * (table_size-1);
-  node = shift_table[k].node;
+	long k = shift_bucket(spline, val, table_size);
+  node = shift_table_pred(set, shift_table, k, val)->next;
 
-  while(node->val > val && k-- > 0) {
-    node = shift_table[k].node;
-  }
-  
   while (node->val < val) {
     (*iterations)++;
     node = node->next;
   }
-  if (node->val == val && !node->deleted) {
+  if (sl_match(node, val) && !node->deleted) {
     result = 1;
   }
 
@@ -161,17 +257,12 @@ int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shif
 }
 
 
-int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations) {
+int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations) {
   sl_node_t *pred, *curr = NULL;
 
-  int k = spline->GetEstimatedPosition(val) * (table_size-1);
-  pred = shift_table[k].node;
-
-  while(pred->val > val && k-- > 0) {
-    pred = shift_table[k].node;
-  }
+  long k = shift_bucket(spline, val, table_size);
+  pred = shift_table_pred(set, shift_table, k, val);
 
-  pred = set->head;
   curr = pred->next;
   while (curr->val < val) {
     pred = curr;
@@ -179,7 +270,7 @@ int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_tab
     (*iterations)++;
   }
 
-  if (curr->val == val ) {
+  if (sl_match(curr, val)) {
     if (curr->deleted) {
       curr->deleted = false;
       return 1;
@@ -193,15 +284,11 @@ int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_tab
 	return 1;
 }
 
-int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations) {
+int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations) {
   sl_node_t *pred, *curr = NULL;
 
-  int k = spline->GetEstimatedPosition(val) * (table_size-1);
-  pred = shift_table[k].node;
-
-  while(pred->val > val && k-- > 0) {
-    pred = shift_table[k].node;
-  }
+  long k = shift_bucket(spline, val, table_size);
+  pred = shift_table_pred(set, shift_table, k, val);
 
   curr = pred->next;
   while (curr->val < val) {
@@ -210,7 +297,7 @@ int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_
     (*iterations)++;
   }
 
-  if (curr->val != val || curr->deleted) {
+  if (!sl_match(curr, val) || curr->deleted) {
     return 0;
   }
   curr->deleted = true;
@@ -228,7 +315,7 @@ int seq_add(sl_intset_t *set, val_t val) {
     curr = curr->next;
   }
 
-  if (curr->val == val) {
+  if (sl_match(curr, val)) {
     return 0;
   }
   sl_node *newnode = sl_new_node(val, curr, 0);
@@ -36,6 +36,21 @@
 
 #include "radix_spline.h"
 
+/*
+ * Spline training. With SPLINE_EYTZINGER, splines also keep their points in
+ * Eytzinger order (see RadixSpline), which speeds up the search of large
+ * radix ranges: many points per prefix, or fewer SPLINE_RADIX_BITS.
+ */
+#ifndef SPLINE_RADIX_BITS
+#define SPLINE_RADIX_BITS               18
+#endif
+#define SPLINE_MAX_ERROR                32
+#ifdef SPLINE_EYTZINGER
+#define SPLINE_LAYOUT                   true
+#else
+#define SPLINE_LAYOUT                   false
+#endif
+
 extern volatile AO_t stop;
 extern unsigned int global_seed;
 #ifdef TLS
@@ -47,10 +62,15 @@ extern unsigned int levelmax;
 
 #define TRANSACTIONAL                   d->unit_tx
 
-typedef intptr_t val_t;
+/*
+ * Keys span the whole unsigned 64-bit domain. The head and tail hold the
+ * bounds, which remain valid keys: searches stop at the first node that is
+ * not smaller than the key, and the tail is told apart by its NULL next.
+ */
+typedef uint64_t val_t;
 typedef intptr_t level_t;
-#define VAL_MIN                         INT_MIN
-#define VAL_MAX                         INT_MAX
+#define VAL_MIN                         0
+#define VAL_MAX                         UINT64_MAX
 
 
 typedef struct sl_node {
@@ -63,23 +83,37 @@ typedef struct sl_intset {
   sl_node_t *head;
 } sl_intset_t;
 
-typedef struct shift_node {
-  int count;
-  int delta;
-  sl_node_t* node;
-}shift_node_t;
+/*
+ * The shift table is stored in groups of SHIFT_GROUP buckets, with the keys
+ * of a group in one cache line and its nodes in the next: the scan for a
+ * start bucket runs over contiguous keys and reads a single node pointer.
+ */
+#define SHIFT_GROUP                     8
+
+typedef struct shift_group {
+  val_t key[SHIFT_GROUP];               /* key of node[i] */
+  sl_node_t *node[SHIFT_GROUP];
+  uint32_t count[SHIFT_GROUP];          /* saturates at UINT32_MAX */
+  int32_t delta[SHIFT_GROUP];           /* rank of the entry minus the bucket, saturated */
+} __attribute__((aligned(64))) shift_group_t;
+
+#define SHIFT_KEY(t, k)                 ((t)[(k) / SHIFT_GROUP].key[(k) % SHIFT_GROUP])
+#define SHIFT_NODE(t, k)                ((t)[(k) / SHIFT_GROUP].node[(k) % SHIFT_GROUP])
+#define SHIFT_COUNT(t, k)               ((t)[(k) / SHIFT_GROUP].count[(k) % SHIFT_GROUP])
+#define SHIFT_DELTA(t, k)               ((t)[(k) / SHIFT_GROUP].delta[(k) % SHIFT_GROUP])
 
 sl_node_t *sl_new_node(val_t val, sl_node_t *next, int transactional);
 void sl_delete_node(sl_node_t *n);
 
 sl_intset_t *sl_set_new();
 void sl_set_delete(sl_intset_t *set);
+sl_intset_t *sl_set_bulk_load(const val_t *keys, size_t n, RadixSpline<val_t> **spline);
 unsigned long sl_set_size(sl_intset_t *set);
 
-shift_node_t *new_shift_table(int table_size);
-void populate_shift_table(sl_intset_t *set, shift_node_t *shift_table, RadixSpline<val_t> *spline, int table_size);
+shift_group_t *new_shift_table(size_t table_size);
+void populate_shift_table(sl_intset_t *set, shift_group_t *shift_table, RadixSpline<val_t> *spline, size_t table_size);
 
 int seq_add(sl_intset_t *set, val_t val);
-int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
-int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
-int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
+int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations);
+int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations);
+int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_group_t *shift_table, size_t table_size, val_t val, unsigned long *iterations);
@@ -0,0 +1,135 @@
+/*
+ * File:
+ *   list_check.cpp
+ * Description:
+ *   Checks of the shift table lookups of the list, run by make check.
+ */
+
+#include "list.h"
+
+#define NB_KEYS                         1000
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+typedef struct check_set {
+  sl_intset_t *set;
+  RadixSpline<val_t> *spline;
+  shift_group_t *shift_table;
+  size_t table_size;
+  unsigned long iterations;
+} check_set_t;
+
+/* Bulk load keys 10, 20, ..., 10 * NB_KEYS with one bucket per key */
+static void check_set_new(check_set_t *c)
+{
+  val_t keys[NB_KEYS];
+  int i;
+
+  for (i = 0; i < NB_KEYS; i++)
+    keys[i] = 10 * (val_t)(i + 1);
+  c->set = sl_set_bulk_load(keys, NB_KEYS, &c->spline);
+  c->table_size = NB_KEYS;
+  c->shift_table = new_shift_table(c->table_size);
+  c->spline->SetNumBuckets(c->table_size);
+  populate_shift_table(c->set, c->shift_table, c->spline, c->table_size);
+  c->iterations = 0;
+}
+
+static void check_set_delete(check_set_t *c)
+{
+  free(c->shift_table);
+  delete c->spline;
+  sl_set_delete(c->set);
+}
+
+static int check_add(check_set_t *c, val_t val)
+{
+  return sl_add(c->set, c->spline, c->shift_table, c->table_size, val, &c->iterations);
+}
+
+static int check_remove(check_set_t *c, val_t val)
+{
+  return sl_remove(c->set, c->spline, c->shift_table, c->table_size, val, &c->iterations);
+}
+
+static int check_contains(check_set_t *c, val_t val)
+{
+  return sl_contains(c->set, c->spline, c->shift_table, c->table_size, val, &c->iterations);
+}
+
+/* Whether the keys of the list are strictly increasing */
+static int check_sorted(check_set_t *c)
+{
+  sl_node_t *node;
+
+  for (node = c->set->head->next; node->next != NULL && node->next->next != NULL; node = node->next)
+    if (node->val >= node->next->val)
+      return 0;
+  return 1;
+}
+
+/* Keys below the first entry, above the last one, and the domain bounds */
+static void check_bounds()
+{
+  const val_t vals[] = { VAL_MIN, 5, 9, 10 * NB_KEYS + 1, VAL_MAX - 1, VAL_MAX };
+  check_set_t c;
+  size_t i;
+
+  check_set_new(&c);
+  for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+    CHECK(!check_contains(&c, vals[i]));
+    CHECK(check_add(&c, vals[i]));
+    CHECK(!check_add(&c, vals[i]));
+    CHECK(check_contains(&c, vals[i]));
+  }
+  CHECK(check_sorted(&c));
+  CHECK(sl_set_size(c.set) == NB_KEYS + sizeof(vals) / sizeof(vals[0]));
+  for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+    CHECK(check_remove(&c, vals[i]));
+    CHECK(!check_remove(&c, vals[i]));
+    CHECK(!check_contains(&c, vals[i]));
+  }
+  CHECK(sl_set_size(c.set) == NB_KEYS);
+  CHECK(check_contains(&c, 10) && check_contains(&c, 10 * NB_KEYS));
+  check_set_delete(&c);
+}
+
+/* Every bulk loaded key, then every key again, a shift table entry or not */
+static void check_remove_all()
+{
+  check_set_t c;
+  val_t val;
+
+  check_set_new(&c);
+  for (val = 10; val <= 10 * NB_KEYS; val += 10) {
+    CHECK(check_contains(&c, val));
+    CHECK(check_remove(&c, val));
+    CHECK(!check_contains(&c, val));
+  }
+  CHECK(sl_set_size(c.set) == 0);
+  for (val = 10; val <= 10 * NB_KEYS; val += 10)
+    CHECK(check_add(&c, val));
+  CHECK(check_sorted(&c));
+  CHECK(sl_set_size(c.set) == NB_KEYS);
+  check_set_delete(&c);
+}
+
+int main()
+{
+  check_bounds();
+  check_remove_all();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
@@ -29,6 +29,9 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "builder.h"
@@ -79,46 +82,33 @@ void barrier_cross(barrier_t *b)
     pthread_mutex_unlock(&b->mutex);
 }
 
-/* 
- * Returns a pseudo-random value in [1; range].
- * Depending on the symbolic constant RAND_MAX>=32767 defined in stdlib.h,
- * the granularity of rand() could be lower-bounded by the 32767^th which might 
- * be too high for given program options [r]ange and [i]nitial.
+/*
+ * Returns a pseudo-random value in [1; range], for any 64-bit range.
+ * rand() only yields 31 random bits (RAND_MAX=2^31-1 in glibc), so three
+ * draws are combined into 64 bits, which are then scaled to the range with
+ * a 128-bit multiply rather than a modulo.
  *
  * Note: this is not thread-safe and will introduce futex locks
  */
-inline long rand_range(long r) {
-  //int m = RAND_MAX;
-  int m = 2147483647;
-    long d, v = 0;
-    
-    do {
-        d = (m > r ? r : m);
-        v += 1 + (long)(d * ((double)rand()/((double)(m)+1.0)));
-        r -= m;
-    } while (r > 0);
-    return v;
+inline unsigned long rand_range(unsigned long r) {
+    uint64_t x = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 2) ^ (uint64_t)rand();
+
+    return 1 + (unsigned long)(((unsigned __int128)x * r) >> 64);
 }
-long rand_range(long r);
+unsigned long rand_range(unsigned long r);
 
 /* Thread-safe, re-entrant version of rand_range(r) */
-inline long rand_range_re(unsigned int *seed, long r) {
-    int m = 2147483647;
-    long d, v = 0;
-    
-    do {
-        d = (m > r ? r : m);		
-        v += 1 + (long)(d * ((double)rand_r(seed)/((double)(m)+1.0)));
-        r -= m;
-    } while (r > 0);
-    return v;
+inline unsigned long rand_range_re(unsigned int *seed, unsigned long r) {
+    uint64_t x = ((uint64_t)rand_r(seed) << 33) ^ ((uint64_t)rand_r(seed) << 2) ^ (uint64_t)rand_r(seed);
+
+    return 1 + (unsigned long)(((unsigned __int128)x * r) >> 64);
 }
-long rand_range_re(unsigned int *seed, long r);
+unsigned long rand_range_re(unsigned int *seed, unsigned long r);
 
 
 typedef struct thread_data {
     val_t first;
-    long range;
+    unsigned long range;
     int update;
     int unit_tx;
     int alternate;
@@ -141,10 +131,10 @@ typedef struct thread_data {
     unsigned int seed;
     sl_intset_t *set;
     RadixSpline<val_t> *spline;
-    shift_node_t *shift_table;
-    // uint64_t * data_set;
+    shift_group_t *shift_table;
+    uint64_t *data_set;
     unsigned long iterations;
-    int table_size;
+    size_t table_size;
     barrier_t *barrier;
     unsigned long failures_because_contention;
 } thread_data_t;
@@ -181,45 +171,94 @@ void* thread_function(void* arg) {
 }
 #endif
 
-uint64_t* load_data(const char* filename, long* size) {
-    FILE* in = fopen(filename, "rb");
-    if (!in) {
+/*
+ * Map a SOSD-style dataset: an 8-byte key count followed by the keys as
+ * sorted uint64 values. The file is mapped read-only instead of copied, so
+ * the keys stay in the page cache only. Returns the keys, and their number
+ * in *size.
+ */
+uint64_t* load_data(const char* filename, unsigned long* size) {
+    struct stat st;
+    uint64_t* map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
         fprintf(stderr, "Unable to open %s\n", filename);
         exit(EXIT_FAILURE);
     }
-
-    // Read size.
-    uint64_t file_size;
-    if (fread(&file_size, sizeof(uint64_t), 1, in) != 1) {
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(uint64_t)) {
         fprintf(stderr, "Error reading size from %s\n", filename);
-        fclose(in);
         exit(EXIT_FAILURE);
     }
-
-    size_t data_size = (size_t)file_size;
-    uint64_t* data = (uint64_t*)malloc(data_size * sizeof(uint64_t));
-    if (!data) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(in);
+    map = (uint64_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
         exit(EXIT_FAILURE);
     }
+    close(fd);
 
-    // Read values.
-    if (fread(data, sizeof(uint64_t), data_size, in) != data_size) {
+    if (map[0] > ((size_t)st.st_size - sizeof(uint64_t)) / sizeof(uint64_t)) {
         fprintf(stderr, "Error reading data from %s\n", filename);
-        free(data);
-        fclose(in);
         exit(EXIT_FAILURE);
     }
+    *size = (unsigned long)map[0];
+
+    return map + 1;
+}
+
+/* Key for a random operation: a random element of the dataset, if any */
+inline val_t rand_key_re(thread_data_t *d) {
+    unsigned long r = rand_range_re(&d->seed, d->range);
+
+    return (d->data_set != NULL) ? (val_t)d->data_set[r - 1] : r;
+}
+val_t rand_key_re(thread_data_t *d);
 
-    fclose(in);
-    *size = data_size;
+int compare_val(const void *a, const void *b) {
+    val_t x = *(const val_t *)a, y = *(const val_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Draw n distinct keys in [1, range], in increasing order, for bulk loading.
+ * Dense draws use selection sampling, which needs no retries; sparse ones
+ * sort the draws and redraw the duplicates.
+ */
+val_t *random_keys(size_t n, unsigned long range) {
+    val_t *keys;
+    unsigned long v;
+    size_t i, m;
 
-    return data;
+    if ((keys = (val_t *)malloc((n > 0 ? n : 1) * sizeof(val_t))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (range < 4UL * n) {
+        for (v = 1, m = 0; m < n; v++)
+            if ((range - v + 1) * ((double)rand() / ((double)RAND_MAX + 1.0)) < n - m)
+                keys[m++] = v;
+        return keys;
+    }
+    m = 0;
+    while (m < n) {
+        for (i = m; i < n; i++)
+            keys[i] = rand_range(range);
+        qsort(keys, n, sizeof(val_t), compare_val);
+        for (i = 1, m = 1; i < n; i++)
+            if (keys[i] != keys[m - 1])
+                keys[m++] = keys[i];
+    }
+    return keys;
 }
 
 void *test(void *data) {
-    int unext, last = -1; 
+    int unext, has_last = 0;
+    val_t last = 0;
     val_t val = 0;
 
     thread_data_t *d = (thread_data_t *)data;
@@ -228,19 +267,20 @@ void *test(void *data) {
     barrier_cross(d->barrier);
 
     /* Is the first op an update? */
-    unext = (rand_range_re(&d->seed, 100) - 1 < d->update);
+    unext = ((int)rand_range_re(&d->seed, 100) - 1 < d->update);
 
 
     while (AO_load_full(&stop) == 0) {
         
         if (unext) { // update
             
-            if (last < 0) { // add
+            if (!has_last) { // add
         
-                val = rand_range_re(&d->seed, d->range);
+                val = rand_key_re(d);
                 if (sl_add(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations)) {
                     d->nb_added++;
                     last = val;
+                    has_last = 1;
                 } 				
                 d->nb_add++;
                 
@@ -250,15 +290,15 @@ void *test(void *data) {
                     if (sl_remove(d->set, d->spline, d->shift_table, d->table_size, last, &d->iterations)) {
                         d->nb_removed++;
                     } 
-                    last = -1;
+                    has_last = 0;
                 } else {
                     /* Random computation only in non-alternated cases */
-                    val = rand_range_re(&d->seed, d->range);
+                    val = rand_key_re(d);
                     /* Remove one random value */
                     if (sl_remove(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations)) {
                         d->nb_removed++;
                         /* Repeat until successful, to avoid size variations */
-                        last = -1;
+                        has_last = 0;
                     } 
                 }
                 d->nb_remove++;
@@ -268,22 +308,23 @@ void *test(void *data) {
                 
             if (d->alternate) {
                 if (d->update == 0) {
-                    if (last < 0) {
+                    if (!has_last) {
                         val = d->first;
                         last = val;
-                    } else { // last >= 0
-                        val = rand_range_re(&d->seed, d->range);
-                        last = -1;
+                        has_last = 1;
+                    } else { // has_last
+                        val = rand_key_re(d);
+                        has_last = 0;
                     }
                 } else { // update != 0
-                    if (last < 0) {
-                        val = rand_range_re(&d->seed, d->range);
+                    if (!has_last) {
+                        val = rand_key_re(d);
                         //last = val;
                     } else {
                         val = last;
                     }
                 }
-            }	else val = rand_range_re(&d->seed, d->range);
+            }	else val = rand_key_re(d);
             
             if (sl_contains(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations)) 
                 d->nb_found++;
@@ -296,7 +337,7 @@ void *test(void *data) {
             unext = ((100 * (d->nb_added + d->nb_removed))
                          < (d->update * (d->nb_add + d->nb_remove + d->nb_contains)));
         } else { // remove/add (even failed) is considered as an update
-            unext = (rand_range_re(&d->seed, 100) - 1 < d->update);
+            unext = ((int)rand_range_re(&d->seed, 100) - 1 < d->update);
         }
     }
     
@@ -318,13 +359,14 @@ int main(int argc, char **argv) {
         {"seed",                      required_argument, NULL, 'S'},
         {"update-rate",               required_argument, NULL, 'u'},
         {"elasticity",                required_argument, NULL, 'x'},
+        {"dataset",                   required_argument, NULL, 'D'},
         {NULL, 0, NULL, 0}
     };
     
     sl_intset_t *set;
-    int i, c, size;
-    val_t last = 0; 
-    val_t val = 0;
+    int i, c;
+    unsigned long size;
+    val_t last = 0;
     unsigned long reads, effreads, updates, effupds, aborts, aborts_locked_read, 
     aborts_locked_write, aborts_validate_read, aborts_validate_write, 
     aborts_validate_commit, aborts_invalid_memory, aborts_double_write, 
@@ -336,20 +378,22 @@ int main(int argc, char **argv) {
     struct timeval start, end;
     struct timespec timeout;
     int duration = DEFAULT_DURATION;
-    int initial = DEFAULT_INITIAL;
+    unsigned long initial = DEFAULT_INITIAL;
     int nb_threads = DEFAULT_NB_THREADS;
-    long range = DEFAULT_RANGE;
+    unsigned long range = DEFAULT_RANGE;
     int seed = DEFAULT_SEED;
     int update = DEFAULT_UPDATE;
     int unit_tx = DEFAULT_ELASTICITY;
     int alternate = DEFAULT_ALTERNATE;
     int effective = DEFAULT_EFFECTIVE;
-    int table_size = -1;
+    long table_size = -1;
+    char *dataset = NULL;
+    uint64_t *data_set = NULL;
     sigset_t block_set;
     
     while(1) {
         i = 0;
-        c = getopt_long(argc, argv, "hAf:d:i:t:r:S:u:T:z:x:", long_options, &i);
+        c = getopt_long(argc, argv, "hAf:d:i:t:r:S:u:T:z:x:D:", long_options, &i);
         
         if(c == -1)
             break;
@@ -396,6 +440,8 @@ int main(int argc, char **argv) {
                                  "        4 = read/add/rem elastic-tx,\n"
                                  "        5 = all recursive elastic-tx,\n"
                                  "        6 = harris lock-free\n"
+                                 "  -D, --dataset <file>\n"
+                                 "        Draw keys from a SOSD dataset (count, then sorted uint64 keys)\n"
                                  );
                     exit(0);
                 case 'A':
@@ -408,13 +454,13 @@ int main(int argc, char **argv) {
                     duration = atoi(optarg);
                     break;
                 case 'i':
-                    initial = atoi(optarg);
+                    initial = strtoul(optarg, NULL, 10);
                     break;
                 case 't':
                     nb_threads = atoi(optarg);
                     break;
                 case 'r':
-                    range = atol(optarg);
+                    range = strtoul(optarg, NULL, 10);
                     break;
                 case 'S':
                     seed = atoi(optarg);
@@ -423,11 +469,14 @@ int main(int argc, char **argv) {
                     update = atoi(optarg);
                     break;
                 case 'T':
-                    table_size = atoi(optarg);
+                    table_size = atol(optarg);
                     break;
                 case 'x':
                     unit_tx = atoi(optarg);
                     break;
+                case 'D':
+                    dataset = optarg;
+                    break;
                 case '?':
                     printf("Use -h or --help for help\n");
                     exit(0);
@@ -438,23 +487,42 @@ int main(int argc, char **argv) {
     if (table_size == -1) {
     table_size = initial;
   }
+    if (dataset != NULL) {
+        /* Operations then draw keys from the dataset: the range is its size */
+        data_set = load_data(dataset, &range);
+        for (size_t j = 1; j < range; j++) {
+            if (data_set[j] < data_set[j - 1]) {
+                fprintf(stderr, "Keys of %s are not sorted\n", dataset);
+                exit(1);
+            }
+        }
+    }
     
     assert(duration >= 0);
-    assert(initial >= 0);
     assert(nb_threads > 0);
     assert(range > 0 && range >= initial);
     assert(update >= 0 && update <= 100);
     
     printf("Bench type   : linked list\n");
     printf("Duration     : %d\n", duration);
-    printf("Initial size : %d\n", initial);
+    printf("Initial size : %lu\n", initial);
     printf("Nb threads   : %d\n", nb_threads);
-    printf("Value range  : %ld\n", range);
+    printf("Value range  : %lu\n", range);
     printf("Seed         : %d\n", seed);
     printf("Update rate  : %d\n", update);
     printf("Elasticity   : %d\n", unit_tx);
     printf("Alternate    : %d\n", alternate);
     printf("Effective    : %d\n", effective);
+    printf("Dataset      : %s\n", (dataset != NULL) ? dataset : "none");
+    printf("Spline       : %d radix bits, %s layout\n", SPLINE_RADIX_BITS,
+           SPLINE_LAYOUT ? "Eytzinger" : "sorted");
+#if defined(__AVX512F__)
+    printf("SIMD         : avx512f\n");
+#elif defined(__AVX2__)
+    printf("SIMD         : avx2\n");
+#else
+    printf("SIMD         : none\n");
+#endif
     printf("Type sizes   : int=%d/long=%d/ptr=%d/word=%d\n",
                  (int)sizeof(int),
                  (int)sizeof(long),
@@ -478,26 +546,34 @@ int main(int argc, char **argv) {
     else
         srand(seed);
     
-    set = sl_set_new();
     stop = 0;
     
 
-    // uint64_t* data_set = load_data("./data/uniform_dense_200M_uint64", &range);
-
-    sl_node_t* node = set->head;
-    /* Populate set */
-    printf("Adding %d entries to set\n", initial);
-    i = 0;
-    while (i < initial) {
-        val = rand_range(range);
-        if (seq_add(set, val)) {
-            last = val;
-            i++;
+    /* Populate set and train the spline */
+    printf("Adding %lu entries to set\n", initial);
+    RadixSpline<val_t> *spline;
+    val_t *keys = random_keys(initial, range);
+    size_t nb_keys = initial;
+    if (data_set != NULL) {
+        /* Draw ranks, then look the keys up: the dataset may repeat keys */
+        nb_keys = 0;
+        for (size_t j = 0; j < initial; j++) {
+            val_t val = (val_t)data_set[keys[j] - 1];
+            if (nb_keys == 0 || val != keys[nb_keys - 1])
+                keys[nb_keys++] = val;
         }
     }
+    set = sl_set_bulk_load(keys, nb_keys, &spline);
+    if (nb_keys > 0)
+        last = keys[nb_keys - 1];
+    free(keys);
+    if (spline == NULL) {
+        fprintf(stderr, "Not enough keys to train the spline\n");
+        exit(1);
+    }
 
-  
-  long min, max;
+  sl_node_t* node;
+  val_t min, max;
   node = set->head->next;
   while (node->next->next != NULL) {
     if (node->val > node->next->val) {
@@ -513,25 +589,15 @@ int main(int argc, char **argv) {
   printf("Min: %lu\n", min);
   printf("Max: %lu\n", max);
 
-  //init spline builder
-  Builder<val_t> splineBuilder(min, max);
-
-  //add to spline
-  node = set->head;
-  while (node->next->next != NULL) {
-    node = node->next;
-    splineBuilder.AddKey(node->val);
-  }
-  
-  //finilize spline
-  RadixSpline<val_t> *spline = splineBuilder.Finalize();
-
   size = sl_set_size(set);
-  printf("Set size     : %d\n", size);
-  printf("Shift table size: %d\n", table_size);
+  printf("Set size     : %lu\n", size);
+  printf("Shift table size: %ld\n", table_size);
 
   //create a shift table
-  shift_node_t *shift_table = new_shift_table(table_size);
+  shift_group_t *shift_table = new_shift_table(table_size);
+
+  //map keys straight to buckets of the table
+  spline->SetNumBuckets(table_size);
 
   //populate the shift table
   populate_shift_table(set, shift_table, spline, table_size);
@@ -569,7 +635,7 @@ int main(int argc, char **argv) {
         data[i].seed = rand();
         data[i].set = set;
         data[i].spline = spline;
-        // data[i].data_set = data_set;
+        data[i].data_set = data_set;
         data[i].shift_table = shift_table;
         data[i].table_size = table_size;
         data[i].barrier = &barrier;
@@ -666,7 +732,7 @@ int main(int argc, char **argv) {
         iters += (double) data[i].iterations / (data[i].nb_contains + (data[i].nb_add + data[i].nb_remove));
     }
     iters /= nb_threads;
-    printf("Set size      : %d (expected: %d)\n", sl_set_size(set), size);
+    printf("Set size      : %lu (expected: %lu)\n", sl_set_size(set), size);
     printf("Duration      : %d (ms)\n", duration);
     printf("Iterations    : %f\n", iters);
     printf("#txs          : %lu (%f / s)\n", reads + updates,
@@ -0,0 +1,190 @@
+/*
+ * File:
+ *   arena.cpp
+ * Description:
+ *   Size-classed, per-thread allocator for skip list nodes.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic_ops.h>
+
+typedef struct arena_block {
+  struct arena_block *next;
+  struct arena_block *batch;            /* next batch in the depot */
+} arena_block_t;
+
+typedef struct arena_thread {
+  char *cursor;
+  char *end;
+  arena_block_t *free[ARENA_NB_CLASSES];
+  size_t nb_free[ARENA_NB_CLASSES];
+} arena_thread_t;
+
+char *volatile arena_base = NULL;
+static volatile AO_t arena_top = 0;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread arena_thread_t arena_self;
+
+/*
+ * Blocks freed by a thread other than the one that allocated them would pile
+ * up on the free lists of threads that never allocate. Free lists are thus
+ * bounded: past 2 * ARENA_BATCH blocks, a batch moves to a shared depot,
+ * which a thread whose list ran dry draws from before it carves new blocks.
+ */
+static arena_block_t *volatile arena_depot[ARENA_NB_CLASSES];
+
+/* Classes: 16 and 32 bytes, then every multiple of a cache line */
+static inline int arena_class(size_t size) {
+  if (size <= 16)
+    return 0;
+  if (size <= 32)
+    return 1;
+  return 1 + (int)((size + ARENA_LINE - 1) / ARENA_LINE);
+}
+
+static inline size_t arena_class_size(int c) {
+  return (c < 2) ? ((size_t)16 << c) : (size_t)(c - 1) * ARENA_LINE;
+}
+
+static void arena_reserve()
+{
+  void *base;
+
+  pthread_mutex_lock(&arena_lock);
+  if (arena_base == NULL) {
+    base = mmap(NULL, ARENA_RESERVE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    arena_base = (char *)base;
+  }
+  pthread_mutex_unlock(&arena_lock);
+}
+
+/* Give the calling thread a fresh chunk; the rest of the old one is dropped */
+static void arena_refill(arena_thread_t *self)
+{
+  AO_t offset;
+
+  if (arena_base == NULL)
+    arena_reserve();
+  offset = AO_fetch_and_add_full(&arena_top, ARENA_CHUNK);
+  if (offset + ARENA_CHUNK > ARENA_RESERVE) {
+    fprintf(stderr, "Node arena exhausted\n");
+    exit(1);
+  }
+  self->cursor = arena_base + offset;
+  self->end = self->cursor + ARENA_CHUNK;
+}
+
+/* Hand the blocks of list over to the depot of class c */
+static void arena_deposit(int c, arena_block_t *list)
+{
+  pthread_mutex_lock(&arena_lock);
+  list->batch = arena_depot[c];
+  arena_depot[c] = list;
+  pthread_mutex_unlock(&arena_lock);
+}
+
+/* Take a batch from the depot of class c as the free list, if there is one */
+static int arena_withdraw(arena_thread_t *self, int c)
+{
+  arena_block_t *b;
+  size_t n = 0;
+
+  if (arena_depot[c] == NULL)
+    return 0;
+  pthread_mutex_lock(&arena_lock);
+  b = arena_depot[c];
+  if (b != NULL)
+    arena_depot[c] = b->batch;
+  pthread_mutex_unlock(&arena_lock);
+  if (b == NULL)
+    return 0;
+  self->free[c] = b;
+  for (; b != NULL; b = b->next)
+    n++;
+  self->nb_free[c] = n;
+  return 1;
+}
+
+void *arena_alloc(size_t size)
+{
+  arena_thread_t *self = &arena_self;
+  arena_block_t *b;
+  size_t align;
+  char *p;
+  int c;
+
+  assert(size <= ARENA_MAX_SIZE);
+  c = arena_class(size);
+  b = self->free[c];
+  if (b == NULL && arena_withdraw(self, c))
+    b = self->free[c];
+  if (b != NULL) {
+    self->free[c] = b->next;
+    self->nb_free[c]--;
+    return b;
+  }
+  size = arena_class_size(c);
+  align = (size < ARENA_LINE) ? size : ARENA_LINE;
+  p = (char *)(((uintptr_t)self->cursor + align - 1) & ~(uintptr_t)(align - 1));
+  if (self->cursor == NULL || p + size > self->end) {
+    arena_refill(self);
+    p = self->cursor;
+  }
+  self->cursor = p + size;
+  return p;
+}
+
+/*
+ * Return a block to the calling thread's free list; size must be the one
+ * it was allocated with. The oldest blocks go to the depot once the list is
+ * too long.
+ */
+void arena_free(void *ptr, size_t size)
+{
+  arena_thread_t *self = &arena_self;
+  arena_block_t *b = (arena_block_t *)ptr;
+  int c = arena_class(size);
+  size_t n;
+
+  b->next = self->free[c];
+  self->free[c] = b;
+  if (++self->nb_free[c] < 2 * ARENA_BATCH)
+    return;
+  for (n = 1; n < ARENA_BATCH; n++)
+    b = b->next;
+  arena_deposit(c, b->next);
+  b->next = NULL;
+  self->nb_free[c] = ARENA_BATCH;
+}
+
+void arena_thread_exit()
+{
+  arena_thread_t *self = &arena_self;
+  int c;
+
+  for (c = 0; c < ARENA_NB_CLASSES; c++) {
+    if (self->free[c] != NULL)
+      arena_deposit(c, self->free[c]);
+    self->free[c] = NULL;
+    self->nb_free[c] = 0;
+  }
+}
+
+void arena_handle_overflow()
+{
+  fprintf(stderr, "Node arena past the %lu GB reach of handles\n",
+          ((1UL << 32) * ARENA_UNIT) >> 30);
+  exit(1);
+}
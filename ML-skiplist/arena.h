@@ -0,0 +1,58 @@
+/*
+ * File:
+ *   arena.h
+ * Description:
+ *   Size-classed, per-thread allocator for skip list nodes.
+ *
+ *   All blocks come from one virtual region reserved up front. Threads carve
+ *   private chunks out of it and serve allocations from per-class free lists
+ *   and a bump pointer, so the hot path takes no lock and shares no cache
+ *   line. Blocks of up to 32 bytes are aligned on their size and larger ones
+ *   on a cache line, so a node never straddles two lines.
+ *
+ *   Blocks freed by other threads come back through a shared depot, in
+ *   batches. A thread hands its free lists over with arena_thread_exit()
+ *   before it exits; the rest of its last chunk is lost.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_RESERVE                   (1UL << 40)     /* 1 TB of address space */
+#define ARENA_CHUNK                     (1UL << 20)
+#define ARENA_LINE                      64
+#define ARENA_MAX_SIZE                  1024
+#define ARENA_NB_CLASSES                (2 + ARENA_MAX_SIZE / ARENA_LINE)
+#define ARENA_BATCH                     256             /* blocks moved to the depot at once */
+
+/*
+ * 32-bit handles to blocks of at least ARENA_UNIT bytes, for tables that
+ * refer to many blocks; 0 stands for NULL. They reach the first 2^32 units
+ * of the region, i.e., 128 GB: a block past that is a fatal error.
+ */
+#define ARENA_UNIT                      32
+
+extern char *volatile arena_base;
+
+void *arena_alloc(size_t size);
+void arena_free(void *ptr, size_t size);
+void arena_thread_exit();
+void arena_handle_overflow() __attribute__((noreturn));
+
+static inline uint32_t arena_handle(const void *ptr) {
+  size_t unit;
+
+  if (ptr == NULL)
+    return 0;
+  unit = ((const char *)ptr - arena_base) / ARENA_UNIT;
+  if (unit >= UINT32_MAX)
+    arena_handle_overflow();
+  return (uint32_t)(unit + 1);
+}
+
+/* Block of a non-zero handle */
+static inline void *arena_ptr(uint32_t handle) {
+  return arena_base + (size_t)(handle - 1) * ARENA_UNIT;
+}
@@ -13,13 +13,17 @@
 template <class KeyType>
 class Builder {
  public:
+  // With `eytzinger_layout`, the spline also keeps its keys in Eytzinger
+  // order, see `RadixSpline`, which pays off for large splines with few
+  // radix bits.
   Builder(KeyType min_key, KeyType max_key, size_t num_radix_bits = 18,
-          size_t max_error = 32)
+          size_t max_error = 32, bool eytzinger_layout = false)
       : min_key_(min_key),
         max_key_(max_key),
         num_radix_bits_(num_radix_bits),
         num_shift_bits_(GetNumShiftBits(max_key - min_key, num_radix_bits)),
         max_error_(max_error),
+        eytzinger_layout_(eytzinger_layout),
         curr_num_keys_(0),
         curr_num_distinct_keys_(0),
         prev_key_(min_key),
@@ -40,6 +44,44 @@ class Builder {
     AddKey(key, prev_position_ + 1);
   }
 
+  // Adds a key at the given position, e.g., to build the piece of a spline
+  // over the keys of a dense array that start at `position`, see `Append`.
+  void AddKey(KeyType key, size_t position) {
+    // assert(key >= min_key_ && key <= max_key_);
+    // Keys need to be monotonically increasing.
+    assert(key >= prev_key_);
+    // Positions need to be strictly monotonically increasing.
+    assert(position == 0 || position > prev_position_);
+
+    PossiblyAddKeyToSpline(key, position);
+
+    ++curr_num_keys_;
+    prev_key_ = key;
+    prev_position_ = position;
+  }
+
+  // Appends the spline built by `piece` over the keys that directly follow
+  // the ones added so far, at their positions in the whole array. Both
+  // splines end on their last key and `piece` starts on its first one, so
+  // the segment that joins them covers no other key and the result keeps
+  // the `max_error_` guarantee. No key can be added afterwards.
+  void Append(const Builder& piece) {
+    assert(curr_num_keys_ == 0 || piece.min_key_ > prev_key_);
+    if (piece.curr_num_keys_ == 0) return;
+
+    if (curr_num_keys_ > 0 && spline_points_.back().x != prev_key_)
+      AddKeyToSpline(prev_key_, prev_position_);
+    for (const Coord<KeyType>& point : piece.spline_points_)
+      AddKeyToSpline(point.x, point.y);
+    if (piece.spline_points_.back().x != piece.prev_key_)
+      AddKeyToSpline(piece.prev_key_, piece.prev_position_);
+
+    curr_num_keys_ += piece.curr_num_keys_;
+    curr_num_distinct_keys_ += piece.curr_num_distinct_keys_;
+    prev_key_ = piece.prev_key_;
+    prev_position_ = piece.prev_position_;
+  }
+
   // Finalizes the construction and returns a read-only `RadixSpline`.
   RadixSpline<KeyType>* Finalize() {
     // Last key needs to be equal to `max_key_`.
@@ -54,7 +96,8 @@ class Builder {
 
     return new RadixSpline<KeyType>(
         min_key_, max_key_, curr_num_keys_, num_radix_bits_, num_shift_bits_,
-        max_error_, std::move(radix_table_), std::move(spline_points_));
+        max_error_, std::move(radix_table_), std::move(spline_points_),
+        eytzinger_layout_);
   }
 
  private:
@@ -78,20 +121,6 @@ class Builder {
   //   return 8 - num_radix_bits - clzl;
   // }
 
-  void AddKey(KeyType key, size_t position) {
-    // assert(key >= min_key_ && key <= max_key_);
-    // Keys need to be monotonically increasing.
-    assert(key >= prev_key_);
-    // Positions need to be strictly monotonically increasing.
-    assert(position == 0 || position > prev_position_);
-
-    PossiblyAddKeyToSpline(key, position);
-
-    ++curr_num_keys_;
-    prev_key_ = key;
-    prev_position_ = position;
-  }
-
   void AddKeyToSpline(KeyType key, double position) {
     spline_points_.push_back({key, position});
     PossiblyAddKeyToRadixTable(key);
@@ -226,6 +255,7 @@ class Builder {
   const size_t num_radix_bits_;
   const size_t num_shift_bits_;
   const size_t max_error_;
+  const bool eytzinger_layout_;
 
   std::vector<uint32_t> radix_table_;
   std::vector<Coord<KeyType>> spline_points_;
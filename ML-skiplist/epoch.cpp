@@ -0,0 +1,244 @@
+/*
+ * File:
+ *   epoch.cpp
+ * Description:
+ *   Epoch-based grace periods for the lock-free skip list.
+ */
+
+#include "epoch.h"
+
+volatile AO_t epoch_global = 1;
+__thread epoch_thread_t *epoch_self = NULL;
+
+/*
+ * Registered threads. Scans walk the list without a lock; registering and
+ * unregistering take epoch_lock, and an unlinked record is only freed once
+ * every scan that could still be on it is over, see epoch_thread_exit().
+ */
+static epoch_thread_t *volatile epoch_threads = NULL;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Counts of the threads that unregistered */
+static unsigned long epoch_nb_retired = 0;
+static unsigned long epoch_nb_freed = 0;
+
+/*
+ * Register the calling thread. Called lazily by the first epoch_enter().
+ */
+void epoch_thread_init()
+{
+  epoch_thread_t *t;
+
+  if (epoch_self != NULL)
+    return;
+  if ((t = (epoch_thread_t *)malloc(sizeof(epoch_thread_t))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  t->epoch = 0;
+  t->scans = 0;
+  t->current = NULL;
+  t->limbo_head = NULL;
+  t->limbo_tail = NULL;
+  t->spare = NULL;
+  t->nb_retired = 0;
+  t->nb_freed = 0;
+  pthread_mutex_lock(&epoch_lock);
+  t->next = epoch_threads;
+  AO_store_full((volatile AO_t *)&epoch_threads, (AO_t)t);
+  pthread_mutex_unlock(&epoch_lock);
+  epoch_self = t;
+}
+
+/* Bracket a walk over the registered threads */
+static inline epoch_thread_t *epoch_scan_begin()
+{
+  if (epoch_self == NULL)
+    epoch_thread_init();
+  /* Full barrier: an unregistering thread sees the scan or the scan misses it */
+  AO_fetch_and_add1_full(&epoch_self->scans);
+  return (epoch_thread_t *)AO_load_full((volatile AO_t *)&epoch_threads);
+}
+
+static inline void epoch_scan_end()
+{
+  AO_fetch_and_add1_full(&epoch_self->scans);
+}
+
+/*
+ * Wait for a grace period: on return, every operation that was running when
+ * this was called has completed. Must not be called from inside an operation.
+ */
+void epoch_synchronize()
+{
+  epoch_thread_t *t;
+  AO_t target, e;
+
+  assert(epoch_self == NULL || epoch_self->epoch == 0);
+  target = AO_fetch_and_add1_full(&epoch_global) + 1;
+  for (t = epoch_scan_begin(); t != NULL; t = t->next) {
+    while (1) {
+      e = AO_load_full(&t->epoch);
+      if (!(e & EPOCH_ACTIVE) || (e >> 1) >= target)
+        break;
+      sched_yield();
+    }
+  }
+  epoch_scan_end();
+}
+
+/*
+ * Smallest epoch announced by an active thread, or the global epoch if no
+ * thread is inside an operation.
+ */
+static AO_t epoch_min_active()
+{
+  epoch_thread_t *t;
+  AO_t min, e;
+
+  min = AO_load_full(&epoch_global);
+  for (t = epoch_scan_begin(); t != NULL; t = t->next) {
+    e = AO_load_full(&t->epoch);
+    if ((e & EPOCH_ACTIVE) && (e >> 1) < min)
+      min = e >> 1;
+  }
+  epoch_scan_end();
+  return min;
+}
+
+/*
+ * Free the sealed batches of the calling thread that no active thread can
+ * still reach.
+ */
+static void epoch_reclaim(epoch_thread_t *self)
+{
+  epoch_batch_t *b;
+  AO_t min;
+  int i;
+
+  if (self->limbo_head == NULL)
+    return;
+  min = epoch_min_active();
+  while ((b = self->limbo_head) != NULL && b->epoch < min) {
+    for (i = 0; i < b->count; i++)
+      b->obj[i].free(b->obj[i].ptr);
+    self->nb_freed += b->count;
+    self->limbo_head = b->next;
+    if (self->limbo_head == NULL)
+      self->limbo_tail = NULL;
+    b->next = self->spare;
+    self->spare = b;
+  }
+}
+
+/* Stamp the batch being filled and append it to the limbo */
+static void epoch_seal(epoch_thread_t *self)
+{
+  epoch_batch_t *b = self->current;
+
+  /* Move the global epoch on so the batch can expire */
+  b->epoch = AO_fetch_and_add1_full(&epoch_global);
+  if (self->limbo_tail != NULL)
+    self->limbo_tail->next = b;
+  else
+    self->limbo_head = b;
+  self->limbo_tail = b;
+  self->current = NULL;
+}
+
+/*
+ * Hand over an object that has been unlinked from every shared structure.
+ * It is freed with fn(ptr) once all operations that could have observed
+ * it are over. Frees happen in batches of EPOCH_BATCH objects.
+ */
+void epoch_retire(void *ptr, epoch_free_t fn)
+{
+  epoch_thread_t *self;
+  epoch_batch_t *b;
+
+  if (epoch_self == NULL)
+    epoch_thread_init();
+  self = epoch_self;
+  if ((b = self->current) == NULL) {
+    if ((b = self->spare) != NULL) {
+      self->spare = b->next;
+    } else if ((b = (epoch_batch_t *)malloc(sizeof(epoch_batch_t))) == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    b->count = 0;
+    b->next = NULL;
+    self->current = b;
+  }
+  b->obj[b->count].ptr = ptr;
+  b->obj[b->count].free = fn;
+  b->count++;
+  self->nb_retired++;
+  if (b->count < EPOCH_BATCH)
+    return;
+
+  epoch_seal(self);
+  epoch_reclaim(self);
+}
+
+/*
+ * Free everything the calling thread retired, after a grace period, and its
+ * spare batches, before it exits: nobody else would. Then unregister it; it
+ * registers anew if it uses the set again. Must not be called from inside an
+ * operation.
+ */
+void epoch_thread_exit()
+{
+  epoch_thread_t *self = epoch_self;
+  epoch_thread_t *volatile *pred;
+  epoch_thread_t *t;
+  epoch_batch_t *b;
+  AO_t scans;
+
+  if (self == NULL)
+    return;
+  if (self->current != NULL)
+    epoch_seal(self);
+  if (self->limbo_head != NULL) {
+    epoch_synchronize();
+    epoch_reclaim(self);
+  }
+  assert(self->limbo_head == NULL);
+  while ((b = self->spare) != NULL) {
+    self->spare = b->next;
+    free(b);
+  }
+
+  pthread_mutex_lock(&epoch_lock);
+  for (pred = &epoch_threads; *pred != self; pred = &(*pred)->next)
+    ;
+  AO_store_full((volatile AO_t *)pred, (AO_t)self->next);
+  epoch_nb_retired += self->nb_retired;
+  epoch_nb_freed += self->nb_freed;
+  /* Scans that started before the unlink may still be on the record */
+  for (t = epoch_threads; t != NULL; t = t->next) {
+    scans = AO_load_full(&t->scans);
+    while ((scans & 1) && AO_load_full(&t->scans) == scans)
+      sched_yield();
+  }
+  pthread_mutex_unlock(&epoch_lock);
+  epoch_self = NULL;
+  free(self);
+}
+
+/*
+ * Number of objects retired and freed so far by all threads. Only exact
+ * when no thread is retiring concurrently.
+ */
+void epoch_stats(unsigned long *retired, unsigned long *freed)
+{
+  epoch_thread_t *t;
+
+  pthread_mutex_lock(&epoch_lock);
+  *retired = epoch_nb_retired;
+  *freed = epoch_nb_freed;
+  for (t = epoch_threads; t != NULL; t = t->next) {
+    *retired += t->nb_retired;
+    *freed += t->nb_freed;
+  }
+  pthread_mutex_unlock(&epoch_lock);
+}
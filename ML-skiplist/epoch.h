@@ -0,0 +1,81 @@
+/*
+ * File:
+ *   epoch.h
+ * Description:
+ *   Epoch-based grace periods for the lock-free skip list.
+ *
+ *   Every operation on the set runs between epoch_enter() and epoch_exit().
+ *   While inside, a thread advertises the global epoch it observed, so a
+ *   writer that unpublished a shared object can wait in epoch_synchronize()
+ *   until no thread can still be holding a reference to it.
+ *
+ *   Writers that must not block hand unlinked objects to epoch_retire()
+ *   instead. Retired objects wait in per-thread limbo batches stamped with
+ *   the global epoch; a batch is freed once every active thread has
+ *   announced a later epoch.
+ *
+ *   A thread registers on its first epoch_enter() and must call
+ *   epoch_thread_exit() before it exits: that drains its limbo and
+ *   unregisters it, so that scans of the registered threads only cover
+ *   live ones.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <atomic_ops.h>
+
+#define EPOCH_ACTIVE                    ((AO_t)0x01)
+#define EPOCH_BATCH                     64
+
+typedef void (*epoch_free_t)(void *);
+
+typedef struct epoch_batch {
+  AO_t epoch;                           /* global epoch when the batch was sealed */
+  int count;
+  struct epoch_batch *next;
+  struct {
+    void *ptr;
+    epoch_free_t free;
+  } obj[EPOCH_BATCH];
+} epoch_batch_t;
+
+typedef struct epoch_thread {
+  /* (observed global epoch << 1) | EPOCH_ACTIVE while inside an operation, 0 otherwise */
+  volatile AO_t epoch;
+  /* Odd while the thread scans the registered threads */
+  volatile AO_t scans;
+  struct epoch_thread *volatile next;
+  /* Limbo: the batch being filled, then sealed batches from oldest to newest */
+  epoch_batch_t *current;
+  epoch_batch_t *limbo_head;
+  epoch_batch_t *limbo_tail;
+  epoch_batch_t *spare;
+  unsigned long nb_retired;
+  unsigned long nb_freed;
+} epoch_thread_t;
+
+extern volatile AO_t epoch_global;
+extern __thread epoch_thread_t *epoch_self;
+
+void epoch_thread_init();
+void epoch_thread_exit();
+void epoch_synchronize();
+void epoch_retire(void *ptr, epoch_free_t fn);
+void epoch_stats(unsigned long *retired, unsigned long *freed);
+
+static inline void epoch_enter() {
+  if (epoch_self == NULL)
+    epoch_thread_init();
+  /* Full barrier: the announcement must be visible before any shared load */
+  AO_store_full(&epoch_self->epoch, (AO_load_full(&epoch_global) << 1) | EPOCH_ACTIVE);
+}
+
+static inline void epoch_exit() {
+  AO_store_release(&epoch_self->epoch, 0);
+}
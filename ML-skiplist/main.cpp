@@ -29,6 +29,9 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "skiplist.h"
 #include "builder.h"
@@ -42,6 +45,11 @@
 #define DEFAULT_ELASTICITY 4
 #define DEFAULT_ALTERNATE 0
 #define DEFAULT_EFFECTIVE 1
+#define DEFAULT_RETRAIN 0
+#define DEFAULT_LOAD 0
+#define DEFAULT_BATCH 1
+#define RETRAIN_COST 1.5
+#define LEVEL_SAMPLE (1UL << 20)
 
 #define XSTR(s) STR(s)
 #define STR(s) #s
@@ -84,53 +92,39 @@ void barrier_cross(barrier_t *b)
 }
 
 /*
- * Returns a pseudo-random value in [1; range].
- * Depending on the symbolic constant RAND_MAX>=32767 defined in stdlib.h,
- * the granularity of rand() could be lower-bounded by the 32767^th which might
- * be too high for given program options [r]ange and [i]nitial.
+ * Returns a pseudo-random value in [1; range], for any 64-bit range.
+ * rand() only yields 31 random bits (RAND_MAX=2^31-1 in glibc), so three
+ * draws are combined into 64 bits, which are then scaled to the range with
+ * a 128-bit multiply rather than a modulo.
  *
  * Note: this is not thread-safe and will introduce futex locks
  */
-inline long rand_range(long r)
+inline unsigned long rand_range(unsigned long r)
 {
-    // int m = RAND_MAX;
-    int m = 2147483647;
-    long d, v = 0;
+    uint64_t x = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 2) ^ (uint64_t)rand();
 
-    do
-    {
-        d = (m > r ? r : m);
-        v += 1 + (long)(d * ((double)rand() / ((double)(m) + 1.0)));
-        r -= m;
-    } while (r > 0);
-    return v;
+    return 1 + (unsigned long)(((unsigned __int128)x * r) >> 64);
 }
-long rand_range(long r);
+unsigned long rand_range(unsigned long r);
 
 /* Thread-safe, re-entrant version of rand_range(r) */
-inline long rand_range_re(unsigned int *seed, long r)
+inline unsigned long rand_range_re(unsigned int *seed, unsigned long r)
 {
-    int m = 2147483647;
-    long d, v = 0;
+    uint64_t x = ((uint64_t)rand_r(seed) << 33) ^ ((uint64_t)rand_r(seed) << 2) ^ (uint64_t)rand_r(seed);
 
-    do
-    {
-        d = (m > r ? r : m);
-        v += 1 + (long)(d * ((double)rand_r(seed) / ((double)(m) + 1.0)));
-        r -= m;
-    } while (r > 0);
-    return v;
+    return 1 + (unsigned long)(((unsigned __int128)x * r) >> 64);
 }
-long rand_range_re(unsigned int *seed, long r);
+unsigned long rand_range_re(unsigned int *seed, unsigned long r);
 
 typedef struct thread_data
 {
     val_t first;
-    long range;
+    unsigned long range;
     int update;
     int unit_tx;
     int alternate;
     int effective;
+    int batch;
     unsigned long nb_add;
     unsigned long nb_added;
     unsigned long nb_remove;
@@ -148,107 +142,176 @@ typedef struct thread_data
     unsigned long max_retries;
     unsigned int seed;
     sl_intset_t *set;
-    RadixSpline<val_t> *spline;
-    shift_node_t *shift_table;
-    // uint64_t * data_set;
+    uint64_t *data_set;
     unsigned long iterations;
-    int table_size;
     barrier_t *barrier;
     unsigned long failures_because_contention;
 } thread_data_t;
 
+typedef struct retrain_data
+{
+    sl_intset_t *set;
+    size_t table_size;
+    double load;
+    thread_data_t *data;
+    int nb_threads;
+    int interval;
+    /* Operations and iterations seen at the last tick, cost after the last rebuild */
+    unsigned long ops;
+    unsigned long iterations;
+    double cost;
+    unsigned long nb_retrains;
+    unsigned long nb_resizes;
+    unsigned long nb_refreshes;
+} retrain_data_t;
+
 #ifdef PARALLEL_POPULATE
 typedef struct thread_data_populate
 {
-    int initial;
-    long *last;
-    long range;
-    int thread_num;
-    unsigned int seed;
     sl_intset_t *set;
-    pthread_mutex_t *mutex;
-    uint64_t *data_set;
-    int thread_idx;
+    val_t *keys;
+    size_t lo;
+    size_t hi;
+    unsigned int seed;
 } thread_data_populate_t;
 
+/* Insert the keys of rank [lo, hi): threads work on disjoint key ranges */
 void *thread_function(void *arg)
 {
     thread_data_populate_t *d = (thread_data_populate_t *)arg;
-    long val;
-    int i;
-    for (i = 0; i < d->initial; i++)
-    {
-        val = d->data_set[rand_range_re(&d->seed, d->range)];
-        if (set_par_add(d->set, val))
-        {
-            pthread_mutex_lock(d->mutex);
-            *(d->last) = val;
-            pthread_mutex_unlock(d->mutex);
-        }
-        else
-        {
-            i--; // Retry the iteration
-        }
-    }
+    size_t i;
+
+    seed_rand_level(d->seed);
+    for (i = d->lo; i < d->hi; i++)
+        set_par_add(d->set, d->keys[i]);
 
+    epoch_thread_exit();
+    arena_thread_exit();
     pthread_exit(NULL);
 }
 #endif
 
-uint64_t *load_data(const char *filename, long *size)
+/*
+ * Map a SOSD-style dataset: an 8-byte key count followed by the keys as
+ * sorted uint64 values. The file is mapped read-only instead of copied, so
+ * the keys stay in the page cache only. Returns the keys, and their number
+ * in *size.
+ */
+uint64_t *load_data(const char *filename, unsigned long *size)
 {
-    FILE *in = fopen(filename, "rb");
-    if (!in)
+    struct stat st;
+    uint64_t *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
     {
         fprintf(stderr, "Unable to open %s\n", filename);
         exit(EXIT_FAILURE);
     }
-
-    // Read size.
-    uint64_t file_size;
-    if (fread(&file_size, sizeof(uint64_t), 1, in) != 1)
+    if (fstat(fd, &st) < 0)
+    {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(uint64_t))
     {
         fprintf(stderr, "Error reading size from %s\n", filename);
-        fclose(in);
         exit(EXIT_FAILURE);
     }
-
-    size_t data_size = (size_t)file_size;
-    uint64_t *data = (uint64_t *)malloc(data_size * sizeof(uint64_t));
-    if (!data)
+    map = (uint64_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(in);
+        perror("mmap");
         exit(EXIT_FAILURE);
     }
+    close(fd);
 
-    // Read values.
-    if (fread(data, sizeof(uint64_t), data_size, in) != data_size)
+    if (map[0] > ((size_t)st.st_size - sizeof(uint64_t)) / sizeof(uint64_t))
     {
         fprintf(stderr, "Error reading data from %s\n", filename);
-        free(data);
-        fclose(in);
         exit(EXIT_FAILURE);
     }
+    *size = (unsigned long)map[0];
 
-    fclose(in);
-    *size = data_size;
+    return map + 1;
+}
+
+/* Key for a random operation: a random element of the dataset, if any */
+inline val_t rand_key_re(thread_data_t *d)
+{
+    unsigned long r = rand_range_re(&d->seed, d->range);
 
-    return data;
+    return (d->data_set != NULL) ? (val_t)d->data_set[r - 1] : r;
+}
+val_t rand_key_re(thread_data_t *d);
+
+int compare_val(const void *a, const void *b)
+{
+    val_t x = *(const val_t *)a, y = *(const val_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Draw n distinct keys in [1, range], in increasing order, for bulk loading.
+ * Dense draws use selection sampling, which needs no retries; sparse ones
+ * sort the draws and redraw the duplicates.
+ */
+val_t *random_keys(size_t n, unsigned long range)
+{
+    val_t *keys;
+    unsigned long v;
+    size_t i, m;
+
+    if ((keys = (val_t *)malloc((n > 0 ? n : 1) * sizeof(val_t))) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    if (range < 4UL * n)
+    {
+        for (v = 1, m = 0; m < n; v++)
+            if ((range - v + 1) * ((double)rand() / ((double)RAND_MAX + 1.0)) < n - m)
+                keys[m++] = v;
+        return keys;
+    }
+    m = 0;
+    while (m < n)
+    {
+        for (i = m; i < n; i++)
+            keys[i] = rand_range(range);
+        qsort(keys, n, sizeof(val_t), compare_val);
+        for (i = 1, m = 1; i < n; i++)
+            if (keys[i] != keys[m - 1])
+                keys[m++] = keys[i];
+    }
+    return keys;
 }
 
 void *test(void *data)
 {
-    int unext, last = -1;
+    int unext, has_last = 0;
+    val_t last = 0;
     val_t val = 0;
+    val_t *vals;
+    int *found;
+    int i;
 
     thread_data_t *d = (thread_data_t *)data;
 
+    seed_rand_level(d->seed);
+    if ((vals = (val_t *)malloc(d->batch * sizeof(val_t))) == NULL ||
+        (found = (int *)malloc(d->batch * sizeof(int))) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
     /* Wait on barrier */
     barrier_cross(d->barrier);
 
     /* Is the first op an update? */
-    unext = (rand_range_re(&d->seed, 100) - 1 < d->update);
+    unext = ((int)rand_range_re(&d->seed, 100) - 1 < d->update);
 
     while (AO_load_full(&stop) == 0)
     {
@@ -256,14 +319,15 @@ void *test(void *data)
         if (unext)
         { // update
 
-            if (last < 0)
+            if (!has_last)
             { // add
 
-                val = rand_range_re(&d->seed, d->range);
-                if (sl_add(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations))
+                val = rand_key_re(d);
+                if (sl_add(d->set, val, &d->iterations))
                 {
                     d->nb_added++;
                     last = val;
+                    has_last = 1;
                 }
                 d->nb_add++;
             }
@@ -272,27 +336,35 @@ void *test(void *data)
 
                 if (d->alternate)
                 { // alternate mode (default)
-                    if (sl_remove(d->set, d->spline, d->shift_table, d->table_size, last, &d->iterations))
+                    if (sl_remove(d->set, last, &d->iterations))
                     {
                         d->nb_removed++;
                     }
-                    last = -1;
+                    has_last = 0;
                 }
                 else
                 {
                     /* Random computation only in non-alternated cases */
-                    val = rand_range_re(&d->seed, d->range);
+                    val = rand_key_re(d);
                     /* Remove one random value */
-                    if (sl_remove(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations))
+                    if (sl_remove(d->set, val, &d->iterations))
                     {
                         d->nb_removed++;
                         /* Repeat until successful, to avoid size variations */
-                        last = -1;
+                        has_last = 0;
                     }
                 }
                 d->nb_remove++;
             }
         }
+        else if (d->batch > 1)
+        { // batch of reads
+
+            for (i = 0; i < d->batch; i++)
+                vals[i] = rand_key_re(d);
+            d->nb_found += sl_contains_batch(d->set, vals, d->batch, found, &d->iterations);
+            d->nb_contains += d->batch;
+        }
         else
         { // read
 
@@ -300,22 +372,23 @@ void *test(void *data)
             {
                 if (d->update == 0)
                 {
-                    if (last < 0)
+                    if (!has_last)
                     {
                         val = d->first;
                         last = val;
+                        has_last = 1;
                     }
                     else
-                    { // last >= 0
-                        val = rand_range_re(&d->seed, d->range);
-                        last = -1;
+                    { // has_last
+                        val = rand_key_re(d);
+                        has_last = 0;
                     }
                 }
                 else
                 { // update != 0
-                    if (last < 0)
+                    if (!has_last)
                     {
-                        val = rand_range_re(&d->seed, d->range);
+                        val = rand_key_re(d);
                         // last = val;
                     }
                     else
@@ -325,9 +398,9 @@ void *test(void *data)
                 }
             }
             else
-                val = rand_range_re(&d->seed, d->range);
+                val = rand_key_re(d);
 
-            if (sl_contains(d->set, d->spline, d->shift_table, d->table_size, val, &d->iterations))
+            if (sl_contains(d->set, val, &d->iterations))
                 d->nb_found++;
             d->nb_contains++;
         }
@@ -339,13 +412,155 @@ void *test(void *data)
         }
         else
         { // remove/add (even failed) is considered as an update
-            unext = (rand_range_re(&d->seed, 100) - 1 < d->update);
+            unext = ((int)rand_range_re(&d->seed, 100) - 1 < d->update);
         }
     }
 
+    free(vals);
+    free(found);
+    /* Free the nodes this thread removed before its stats are read, and
+       hand its free blocks over to the threads that go on */
+    epoch_thread_exit();
+    arena_thread_exit();
     return NULL;
 }
 
+/*
+ * With a target load (keys per bucket), the index is only rebuilt once it
+ * drifted: into a table of the right size once the load is off by more than
+ * 2x either way, so the table grows and shrinks with the set, or at the same
+ * size once the average iterations per operation grew by RETRAIN_COST since
+ * the first interval after the last rebuild. Returns 1 and 2 respectively,
+ * 0 if the index is kept, and sets *size to the table size to rebuild with.
+ * Nothing is committed to d: the caller does it once the rebuild succeeded.
+ */
+int retrain_needed(retrain_data_t *d, size_t *size)
+{
+    unsigned long ops = 0, iterations = 0;
+    size_t want;
+    double cost;
+    int i;
+
+    for (i = 0; i < d->nb_threads; i++)
+    {
+        ops += d->data[i].nb_add + d->data[i].nb_remove + d->data[i].nb_contains;
+        iterations += d->data[i].iterations;
+    }
+    cost = (ops > d->ops) ? (double)(iterations - d->iterations) / (ops - d->ops) : 0;
+    d->ops = ops;
+    d->iterations = iterations;
+
+    want = (size_t)(AO_load(&d->set->size) / d->load);
+    if (want < 2)
+        want = 2;
+    *size = d->table_size;
+    if (want > 2 * d->table_size || 2 * want < d->table_size)
+    {
+        *size = want;
+        return 1;
+    }
+    if (d->cost == 0)
+        d->cost = cost;
+    else if (cost > RETRAIN_COST * d->cost)
+        return 2;
+    return 0;
+}
+
+/*
+ * Periodically rebuilds the spline and shift table from the live set so the
+ * index keeps up with the keys inserted and removed by the test threads.
+ * Each rebuild runs on as many threads as the test.
+ */
+void *retrain(void *data)
+{
+    retrain_data_t *d = (retrain_data_t *)data;
+    struct timespec timeout;
+    size_t size = d->table_size;
+    int needed = 1;
+
+    timeout.tv_sec = d->interval / 1000;
+    timeout.tv_nsec = (d->interval % 1000) * 1000000;
+
+    while (AO_load_full(&stop) == 0)
+    {
+        nanosleep(&timeout, NULL);
+        if (AO_load_full(&stop) != 0)
+            break;
+        if (d->load > 0 && (needed = retrain_needed(d, &size)) == 0)
+            continue;
+#ifdef SHIFT_REGIONS
+        /* At the right size, rebuilding the table region by region is enough */
+        if (needed == 2)
+        {
+            d->nb_refreshes += sl_refresh_regions(d->set);
+            d->cost = 0;
+            continue;
+        }
+#endif
+        if (!sl_retrain(d->set, size, d->nb_threads))
+            continue;
+        d->nb_retrains++;
+        if (size != d->table_size)
+        {
+            d->table_size = size;
+            d->nb_resizes++;
+        }
+        d->cost = 0;
+    }
+
+    epoch_thread_exit();
+    arena_thread_exit();
+    return NULL;
+}
+
+/*
+ * Compares the levels of a population of n towers with the geometric
+ * distribution get_rand_level() should produce (p=0.5, capped at levelmax).
+ */
+void print_histogram(const char *what, unsigned long *hist, unsigned long n)
+{
+    double expected, chi2 = 0;
+    int l, top = (int)levelmax;
+
+    printf("Level histogram of %s (%lu towers, levelmax %d):\n", what, n, top);
+    for (l = 1; l <= top; l++)
+    {
+        /* The last level also collects every draw above the cap */
+        expected = (double)n / (double)(1UL << (l < top ? l : top - 1));
+        if (expected > 0)
+            chi2 += (hist[l] - expected) * (hist[l] - expected) / expected;
+        printf("  level %2d    : %lu (expected: %.1f)\n", l, hist[l], expected);
+    }
+    printf("  chi-square  : %f (%d degrees of freedom)\n", chi2, top - 1);
+}
+
+/*
+ * Tower heights of the set, then of LEVEL_SAMPLE fresh get_rand_level()
+ * draws. Only the second tests the generator: bulk loaded towers are
+ * 1 + ctz(i) by construction, so the set matches the distribution almost
+ * exactly, save for the keys the run inserted.
+ */
+void print_level_histogram(sl_intset_t *set)
+{
+    unsigned long hist[MAXLEVEL + 1];
+    unsigned long n, i;
+    int l;
+
+#ifdef PARALLEL_POPULATE
+    const char *what = "the set";
+#else
+    const char *what = "the bulk loaded set";
+#endif
+    n = sl_level_histogram(set, hist);
+    print_histogram(what, hist, n);
+
+    for (l = 0; l <= MAXLEVEL; l++)
+        hist[l] = 0;
+    for (i = 0; i < LEVEL_SAMPLE; i++)
+        hist[get_rand_level()]++;
+    print_histogram("get_rand_level() draws", hist, LEVEL_SAMPLE);
+}
+
 /*void catcher(int sig) {
     printf("CAUGHT SIGNAL %d\n", sig);
 }*/
@@ -362,38 +577,52 @@ int main(int argc, char **argv)
         {"seed", required_argument, NULL, 'S'},
         {"update-rate", required_argument, NULL, 'u'},
         {"elasticity", required_argument, NULL, 'x'},
+        {"retrain-interval", required_argument, NULL, 'R'},
+        {"level-histogram", no_argument, NULL, 'H'},
+        {"dataset", required_argument, NULL, 'D'},
+        {"load", required_argument, NULL, 'L'},
+        {"batch", required_argument, NULL, 'B'},
         {NULL, 0, NULL, 0}};
 
     sl_intset_t *set;
-    int i, c, size;
+    int i, c;
+    unsigned long size;
     val_t last = 0;
-    val_t val = 0;
+    val_t val;
     unsigned long reads, effreads, updates, effupds, aborts, aborts_locked_read,
         aborts_locked_write, aborts_validate_read, aborts_validate_write,
         aborts_validate_commit, aborts_invalid_memory, aborts_double_write,
-        max_retries, failures_because_contention;
+        max_retries, failures_because_contention, removed, retired, freed;
     thread_data_t *data;
     pthread_t *threads;
+    pthread_t retrainer;
+    retrain_data_t retrain_data;
     pthread_attr_t attr;
     barrier_t barrier;
     struct timeval start, end;
     struct timespec timeout;
     int duration = DEFAULT_DURATION;
-    int initial = DEFAULT_INITIAL;
+    unsigned long initial = DEFAULT_INITIAL;
     int nb_threads = DEFAULT_NB_THREADS;
-    long range = DEFAULT_RANGE;
+    unsigned long range = DEFAULT_RANGE;
     int seed = DEFAULT_SEED;
     int update = DEFAULT_UPDATE;
     int unit_tx = DEFAULT_ELASTICITY;
     int alternate = DEFAULT_ALTERNATE;
     int effective = DEFAULT_EFFECTIVE;
-    int table_size = -1;
+    long table_size = -1;
+    int retrain_interval = DEFAULT_RETRAIN;
+    double load = DEFAULT_LOAD;
+    int batch = DEFAULT_BATCH;
+    int level_histogram = 0;
+    char *dataset = NULL;
+    uint64_t *data_set = NULL;
     sigset_t block_set;
 
     while (1)
     {
         i = 0;
-        c = getopt_long(argc, argv, "hAf:d:i:t:r:S:u:T:z:x:", long_options, &i);
+        c = getopt_long(argc, argv, "hAHf:d:i:t:r:S:u:T:z:x:R:D:L:B:", long_options, &i);
 
         if (c == -1)
             break;
@@ -440,7 +669,17 @@ int main(int argc, char **argv)
                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                              "        3 = read/add elastic-tx,\n"
                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                              "        4 = read/add/rem elastic-tx,\n"
                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                              "        5 = all recursive elastic-tx,\n"
-                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        6 = harris lock-free\n");
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        6 = harris lock-free\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "  -R, --retrain-interval <int>\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        Milliseconds between index retrains (0=never, default=" XSTR(DEFAULT_RETRAIN) ")\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "  -H, --level-histogram\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        Print the tower heights of the set and of sampled levels against the expected distribution\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "  -D, --dataset <file>\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        Draw keys from a SOSD dataset (count, then sorted uint64 keys)\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "  -L, --load <double>\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        Keys per shift table bucket to keep by resizing on retrains (0=fixed size, default=" XSTR(DEFAULT_LOAD) ")\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "  -B, --batch <int>\n"
+                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                             "        Lookups issued together by read operations (default=" XSTR(DEFAULT_BATCH) ")\n");
             exit(0);
         case 'A':
             alternate = 1;
@@ -452,13 +691,13 @@ int main(int argc, char **argv)
             duration = atoi(optarg);
             break;
         case 'i':
-            initial = atoi(optarg);
+            initial = strtoul(optarg, NULL, 10);
             break;
         case 't':
             nb_threads = atoi(optarg);
             break;
         case 'r':
-            range = atol(optarg);
+            range = strtoul(optarg, NULL, 10);
             break;
         case 'S':
             seed = atoi(optarg);
@@ -467,11 +706,26 @@ int main(int argc, char **argv)
             update = atoi(optarg);
             break;
         case 'T':
-            table_size = atoi(optarg);
+            table_size = atol(optarg);
             break;
         case 'x':
             unit_tx = atoi(optarg);
             break;
+        case 'R':
+            retrain_interval = atoi(optarg);
+            break;
+        case 'H':
+            level_histogram = 1;
+            break;
+        case 'D':
+            dataset = optarg;
+            break;
+        case 'L':
+            load = atof(optarg);
+            break;
+        case 'B':
+            batch = atoi(optarg);
+            break;
         case '?':
             printf("Use -h or --help for help\n");
             exit(0);
@@ -483,23 +737,66 @@ int main(int argc, char **argv)
     {
         table_size = initial;
     }
+    if (dataset != NULL)
+    {
+        /* Operations then draw keys from the dataset: the range is its size */
+        data_set = load_data(dataset, &range);
+        for (size_t j = 1; j < range; j++)
+        {
+            if (data_set[j] < data_set[j - 1])
+            {
+                fprintf(stderr, "Keys of %s are not sorted\n", dataset);
+                exit(1);
+            }
+        }
+    }
 
     assert(duration >= 0);
-    assert(initial >= 0);
     assert(nb_threads > 0);
     assert(range > 0 && range >= initial);
     assert(update >= 0 && update <= 100);
+    assert(retrain_interval >= 0);
+    assert(load >= 0);
+    assert(batch > 0);
+    if (load > 0 && retrain_interval == 0)
+    {
+        fprintf(stderr, "Resizing with --load needs a --retrain-interval\n");
+        exit(1);
+    }
 
     printf("Bench type   : linked list\n");
     printf("Duration     : %d\n", duration);
-    printf("Initial size : %d\n", initial);
+    printf("Initial size : %lu\n", initial);
     printf("Nb threads   : %d\n", nb_threads);
-    printf("Value range  : %ld\n", range);
+    printf("Value range  : %lu\n", range);
     printf("Seed         : %d\n", seed);
     printf("Update rate  : %d\n", update);
     printf("Elasticity   : %d\n", unit_tx);
     printf("Alternate    : %d\n", alternate);
     printf("Effective    : %d\n", effective);
+    printf("Retrain      : %d\n", retrain_interval);
+    printf("Load         : %g\n", load);
+    printf("Batch        : %d\n", batch);
+    printf("Dataset      : %s\n", (dataset != NULL) ? dataset : "none");
+#ifdef SHIFT_TALLEST
+    printf("Shift entry  : tallest node\n");
+#else
+    printf("Shift entry  : first node\n");
+#endif
+#ifdef PREFETCH
+    printf("Prefetch     : yes\n");
+#else
+    printf("Prefetch     : no\n");
+#endif
+    printf("Spline       : %d radix bits, %s layout\n", SPLINE_RADIX_BITS,
+           SPLINE_LAYOUT ? "Eytzinger" : "sorted");
+#if defined(__AVX512F__)
+    printf("SIMD         : avx512f\n");
+#elif defined(__AVX2__)
+    printf("SIMD         : avx2\n");
+#else
+    printf("SIMD         : none\n");
+#endif
     printf("Type sizes   : int=%d/long=%d/ptr=%d/word=%d\n",
            (int)sizeof(int),
            (int)sizeof(long),
@@ -524,27 +821,65 @@ int main(int argc, char **argv)
         srand((int)time(0));
     else
         srand(seed);
+    seed_rand_level(rand());
 
-    set = sl_set_new();
     stop = 0;
 
-    // uint64_t* data_set = load_data("./data/uniform_dense_200M_uint64", &range);
-
-    sl_node_t *node = set->head;
     /* Populate set */
-    printf("Adding %d entries to set\n", initial);
-    i = 0;
-    while (i < initial)
+    printf("Adding %lu entries to set\n", initial);
+    val_t *keys = random_keys(initial, range);
+    size_t nb_keys = initial;
+    if (data_set != NULL)
+    {
+        /* Draw ranks, then look the keys up: the dataset may repeat keys */
+        nb_keys = 0;
+        for (size_t j = 0; j < initial; j++)
+        {
+            val = (val_t)data_set[keys[j] - 1];
+            if (nb_keys == 0 || val != keys[nb_keys - 1])
+                keys[nb_keys++] = val;
+        }
+    }
+#ifdef PARALLEL_POPULATE
+    thread_data_populate_t *populate;
+    if ((populate = (thread_data_populate_t *)malloc(nb_threads * sizeof(thread_data_populate_t))) == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    set = sl_set_new();
+    for (i = 0; i < nb_threads; i++)
+    {
+        populate[i].set = set;
+        populate[i].keys = keys;
+        populate[i].lo = nb_keys * i / nb_threads;
+        populate[i].hi = nb_keys * (i + 1) / nb_threads;
+        populate[i].seed = rand();
+        if (pthread_create(&threads[i], NULL, thread_function, (void *)(&populate[i])) != 0)
+        {
+            fprintf(stderr, "Error creating thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nb_threads; i++)
     {
-        val = rand_range(range);
-        if (seq_add(set, val))
+        if (pthread_join(threads[i], NULL) != 0)
         {
-            last = val;
-            i++;
+            fprintf(stderr, "Error waiting for thread completion\n");
+            exit(1);
         }
     }
+    free(populate);
+    set->index = sl_index_new_par(set, keys, nb_keys, table_size, nb_threads);
+#else
+    set = sl_set_bulk_load(keys, nb_keys, table_size);
+#endif
+    if (nb_keys > 0)
+        last = keys[nb_keys - 1];
+    free(keys);
 
-    long min, max;
+    sl_node_t *node;
+    val_t min, max;
     node = set->head->next[0];
     while (node->next[0]->next[0] != NULL)
     {
@@ -562,30 +897,16 @@ int main(int argc, char **argv)
     printf("Min: %lu\n", min);
     printf("Max: %lu\n", max);
 
-    // init spline builder
-    Builder<val_t> splineBuilder(min, max);
+    size = sl_set_size(set);
+    printf("Set size     : %lu\n", size);
+    printf("Shift table size: %ld (%lu bytes per bucket)\n", table_size, sizeof(shift_group_t) / SHIFT_GROUP);
 
-    // add to spline
-    node = set->head;
-    while (node->next[0]->next[0] != NULL)
+    if (set->index == NULL)
     {
-        node = node->next[0];
-        splineBuilder.AddKey(node->val);
+        fprintf(stderr, "Not enough keys to train the index\n");
+        exit(1);
     }
 
-    // finilize spline
-    RadixSpline<val_t> *spline = splineBuilder.Finalize();
-
-    size = sl_set_size(set);
-    printf("Set size     : %d\n", size);
-    printf("Shift table size: %d\n", table_size);
-
-    // create a shift table
-    shift_node_t *shift_table = new_shift_table(table_size);
-
-    // populate the shift table
-    populate_shift_table(set, shift_table, spline, table_size);
-
     //DEBUG
 
     //print out skiplist
@@ -618,6 +939,7 @@ int main(int argc, char **argv)
         data[i].unit_tx = unit_tx;
         data[i].alternate = alternate;
         data[i].effective = effective;
+        data[i].batch = batch;
         data[i].nb_add = 0;
         data[i].nb_added = 0;
         data[i].nb_remove = 0;
@@ -635,10 +957,7 @@ int main(int argc, char **argv)
         data[i].max_retries = 0;
         data[i].seed = rand();
         data[i].set = set;
-        data[i].spline = spline;
-        // data[i].data_set = data_set;
-        data[i].shift_table = shift_table;
-        data[i].table_size = table_size;
+        data[i].data_set = data_set;
         data[i].barrier = &barrier;
         data[i].failures_because_contention = 0;
         data[i].iterations = 0;
@@ -648,6 +967,23 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    retrain_data.set = set;
+    retrain_data.table_size = table_size;
+    retrain_data.load = load;
+    retrain_data.data = data;
+    retrain_data.nb_threads = nb_threads;
+    retrain_data.interval = retrain_interval;
+    retrain_data.ops = 0;
+    retrain_data.iterations = 0;
+    retrain_data.cost = 0;
+    retrain_data.nb_retrains = 0;
+    retrain_data.nb_resizes = 0;
+    retrain_data.nb_refreshes = 0;
+    if (retrain_interval > 0 && pthread_create(&retrainer, &attr, retrain, (void *)(&retrain_data)) != 0)
+    {
+        fprintf(stderr, "Error creating thread\n");
+        exit(1);
+    }
     pthread_attr_destroy(&attr);
 
     /* Start threads */
@@ -683,6 +1019,11 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    if (retrain_interval > 0 && pthread_join(retrainer, NULL) != 0)
+    {
+        fprintf(stderr, "Error waiting for thread completion\n");
+        exit(1);
+    }
 
     duration = (end.tv_sec * 1000 + end.tv_usec / 1000) - (start.tv_sec * 1000 + start.tv_usec / 1000);
     aborts = 0;
@@ -699,6 +1040,7 @@ int main(int argc, char **argv)
     updates = 0;
     effupds = 0;
     max_retries = 0;
+    removed = 0;
     double iters = 0;
     for (i = 0; i < nb_threads; i++)
     {
@@ -735,12 +1077,13 @@ int main(int argc, char **argv)
         updates += (data[i].nb_add + data[i].nb_remove);
         effupds += data[i].nb_removed + data[i].nb_added;
         size += data[i].nb_added - data[i].nb_removed;
+        removed += data[i].nb_removed;
         if (max_retries < data[i].max_retries)
             max_retries = data[i].max_retries;
         iters += (double)data[i].iterations / (data[i].nb_contains + (data[i].nb_add + data[i].nb_remove));
     }
     iters /= nb_threads;
-    printf("Set size      : %d (expected: %d)\n", sl_set_size(set), size);
+    printf("Set size      : %lu (expected: %lu)\n", sl_set_size(set), size);
     printf("Duration      : %d (ms)\n", duration);
     printf("Iterations    : %f\n", iters);
     printf("#txs          : %lu (%f / s)\n", reads + updates,
@@ -784,9 +1127,21 @@ int main(int argc, char **argv)
            aborts_double_write * 1000.0 / duration);
     printf("  #failures   : %lu\n", failures_because_contention);
     printf("Max retries   : %lu\n", max_retries);
+    printf("#retrains     : %lu\n", retrain_data.nb_retrains);
+    printf("  #resizes    : %lu (table size: %lu)\n", retrain_data.nb_resizes, retrain_data.table_size);
+#ifdef SHIFT_REGIONS
+    printf("  #refreshes  : %lu regions\n", retrain_data.nb_refreshes);
+#endif
+    epoch_stats(&retired, &freed);
+    printf("#removed keys : %lu\n", removed);
+    printf("#retired nodes: %lu\n", retired);
+    printf("  #freed      : %lu\n", freed);
+    if (level_histogram)
+        print_level_histogram(set);
 
     /* Delete set */
     sl_set_delete(set);
+    epoch_thread_exit();
 
     free(threads);
     free(data);
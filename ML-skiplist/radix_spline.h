@@ -5,12 +5,25 @@
 #include <cmath>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 #include "common.h"
 
 // namespace rs {
 
 // Approximates a cumulative distribution function (CDF) using spline
 // interpolation.
+//
+// Segments are stored as a structure of arrays: the keys of the spline
+// points, which `GetSplineSegment` searches, are packed on their own, and
+// each segment keeps the position of its first point and its slope, both
+// already divided by `num_keys_ - 1`, so an estimate takes a single FMA.
+//
+// Large splines can also keep their keys in Eytzinger (BFS) order, for a
+// search with prefetching over all of them: the radix table then only has to
+// narrow down small ranges, and can be much smaller.
 template <class KeyType>
 class RadixSpline {
  public:
@@ -19,15 +32,33 @@ class RadixSpline {
   RadixSpline(KeyType min_key, KeyType max_key, size_t num_keys,
               size_t num_radix_bits, size_t num_shift_bits, size_t max_error,
               std::vector<uint32_t> radix_table,
-              std::vector<Coord<KeyType>> spline_points)
+              std::vector<Coord<KeyType>> spline_points,
+              bool eytzinger_layout = false)
       : min_key_(min_key),
         max_key_(max_key),
         num_keys_(num_keys),
         num_radix_bits_(num_radix_bits),
         num_shift_bits_(num_shift_bits),
         max_error_(max_error),
-        radix_table_(std::move(radix_table)),
-        spline_points_(std::move(spline_points)) {}
+        radix_table_(std::move(radix_table)) {
+    const double scale = (num_keys > 1) ? 1.0 / (num_keys - 1) : 0;
+
+    spline_keys_.resize(spline_points.size() + kPadding, max_key);
+    segments_.resize(spline_points.size());
+    for (size_t i = 0; i < spline_points.size(); ++i) {
+      spline_keys_[i] = spline_points[i].x;
+      segments_[i].intercept = spline_points[i].y * scale;
+      segments_[i].slope = 0;
+      if (i + 1 < spline_points.size()) {
+        // Compute slope.
+        const double x_diff = spline_points[i + 1].x - spline_points[i].x;
+        const double y_diff = spline_points[i + 1].y - spline_points[i].y;
+        segments_[i].slope = y_diff / x_diff * scale;
+      }
+    }
+
+    if (eytzinger_layout) BuildEytzingerLayout();
+  }
 
   // Returns the estimated position of `key`.
   double GetEstimatedPosition(const KeyType key) const {
@@ -37,17 +68,115 @@ class RadixSpline {
 
     // Find spline segment with `key` ∈ (spline[index - 1], spline[index]].
     const size_t index = GetSplineSegment(key);
-    const Coord<KeyType> down = spline_points_[index - 1];
-    const Coord<KeyType> up = spline_points_[index];
-
-    // Compute slope.
-    const double x_diff = up.x - down.x;
-    const double y_diff = up.y - down.y;
-    const double slope = y_diff / x_diff;
+    const Segment& down = segments_[index - 1];
 
     // Interpolate.
-    const double key_diff = key - down.x;
-    return std::fma(key_diff, slope, down.y) / (num_keys_-1);
+    const double key_diff = key - spline_keys_[index - 1];
+    return std::fma(key_diff, down.slope, down.intercept);
+  }
+
+  // Trains `GetBucket` for a table of `num_buckets` buckets, at most 2^32.
+  void SetNumBuckets(size_t num_buckets) {
+    assert(num_buckets > 0 && num_buckets - 1 <= UINT32_MAX);
+    // Positions are fixed point, with 32 fractional bits.
+    const uint64_t max_position = (uint64_t)(num_buckets - 1) << 32;
+    const double scale = std::ldexp((double)(num_buckets - 1), 32);
+    uint64_t end = 0;
+
+    num_buckets_ = num_buckets;
+    buckets_.resize(segments_.size());
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      BucketSegment& bucket = buckets_[i];
+      const double base = segments_[i].intercept * scale;
+
+      // Never start below the end of the previous segment, so that buckets
+      // follow the order of keys across segments too.
+      bucket.base = (base <= 0) ? 0 : (base >= max_position) ? max_position
+                                                              : (uint64_t)base;
+      if (bucket.base < end) bucket.base = end;
+
+      // Slope as a 64-bit multiplier and a shift, with full precision.
+      bucket.mult = 0;
+      bucket.shift = 0;
+      const double slope = segments_[i].slope * scale;
+      if (slope > 0) {
+        int exponent;
+        std::frexp(slope, &exponent);
+        // Slopes below 2^-64 fractional units per key are left flat.
+        if (exponent > -64) {
+          bucket.shift = 64 - exponent;
+          bucket.mult = (uint64_t)std::ldexp(slope, bucket.shift);
+        }
+      }
+
+      if (i + 1 < segments_.size()) {
+        const unsigned __int128 next =
+            bucket.base + (((unsigned __int128)(spline_keys_[i + 1] -
+                                                spline_keys_[i]) *
+                            bucket.mult) >>
+                           bucket.shift);
+        end = (next > max_position) ? max_position : (uint64_t)next;
+      }
+    }
+  }
+
+  // Returns the number of buckets `GetBucket` is trained for.
+  size_t GetNumBuckets() const { return num_buckets_; }
+
+  // Returns the bucket of `key` in the table `SetNumBuckets` was called
+  // for: its estimated position scaled to [0, num_buckets - 1], computed in
+  // fixed point from the exact distance of `key` to its segment.
+  size_t GetBucket(const KeyType key) const {
+    // Truncate to data boundaries.
+    if (key <= min_key_) return 0;
+    if (key >= max_key_) return num_buckets_ - 1;
+
+    // Find spline segment with `key` ∈ (spline[index - 1], spline[index]].
+    return Interpolate(key, GetSplineSegment(key));
+  }
+
+  // Maximum number of keys `GetBuckets` works on at once.
+  static constexpr size_t kBatchSize = 16;
+
+  // Same as `GetBucket` for the `n` keys in `keys`. The keys go through each
+  // step in turn, a batch at a time, and the next step's data is prefetched
+  // for the whole batch, so the cache misses of different keys overlap.
+  void GetBuckets(const KeyType* keys, size_t n, size_t* buckets) const {
+    KeyType prefixes[kBatchSize];
+    uint32_t begins[kBatchSize];
+    size_t indexes[kBatchSize];
+
+    for (size_t first = 0; first < n; first += kBatchSize) {
+      const size_t count = (n - first < kBatchSize) ? n - first : kBatchSize;
+      const KeyType* batch = keys + first;
+
+      GetPrefixes(batch, count, prefixes);
+      for (size_t i = 0; i < count; ++i)
+        if (batch[i] > min_key_ && batch[i] < max_key_)
+          __builtin_prefetch(&radix_table_[prefixes[i]]);
+      for (size_t i = 0; i < count; ++i) {
+        if (batch[i] > min_key_ && batch[i] < max_key_) {
+          begins[i] = radix_table_[prefixes[i]];
+          __builtin_prefetch(&spline_keys_[begins[i]]);
+        }
+      }
+      for (size_t i = 0; i < count; ++i) {
+        if (batch[i] > min_key_ && batch[i] < max_key_) {
+          indexes[i] = SearchSplineSegment(batch[i], begins[i],
+                                           radix_table_[prefixes[i] + 1]);
+          __builtin_prefetch(&buckets_[indexes[i] - 1]);
+        }
+      }
+      for (size_t i = 0; i < count; ++i) {
+        // Truncate to data boundaries.
+        if (batch[i] <= min_key_)
+          buckets[first + i] = 0;
+        else if (batch[i] >= max_key_)
+          buckets[first + i] = num_buckets_ - 1;
+        else
+          buckets[first + i] = Interpolate(batch[i], indexes[i]);
+      }
+    }
   }
 
   // Returns a search bound [begin, end) around the estimated position.
@@ -64,33 +193,182 @@ class RadixSpline {
   // Returns the size in bytes.
   size_t GetSize() const {
     return sizeof(*this) + radix_table_.size() * sizeof(uint32_t) +
-           spline_points_.size() * sizeof(Coord<KeyType>);
+           spline_keys_.size() * sizeof(KeyType) +
+           segments_.size() * sizeof(Segment) +
+           buckets_.size() * sizeof(BucketSegment) +
+           eytzinger_keys_.size() * sizeof(KeyType) +
+           eytzinger_ranks_.size() * sizeof(uint32_t);
   }
 
  private:
+  // Segment from a spline point to the next one, scaled to [0, 1]. The
+  // intercept and slope are read together, so they share an entry.
+  struct Segment {
+    double intercept;
+    double slope;
+  };
+
+  // Segment as seen by `GetBucket`: the position of its first point and its
+  // slope, with 32 fractional bits, the slope shifted left by `shift` more.
+  struct BucketSegment {
+    uint64_t base;
+    uint64_t mult;
+    uint32_t shift;
+  };
+
+  // Number of copies of `max_key_` after the last spline point, so the
+  // search can read whole blocks of keys.
+  static constexpr size_t kPadding = 4;
+
+  // Keys of the Eytzinger layout in a cache line, and so the number of
+  // levels the search prefetches ahead, log2 of it.
+  static constexpr size_t kEytzingerBlock = 64 / sizeof(KeyType);
+
+  // Smallest radix range searched in the Eytzinger layout rather than with
+  // a binary search over the range alone.
+  static constexpr uint32_t kEytzingerMinRange = 256;
+
+  // Lays out the spline keys in Eytzinger order, 1-based: the children of
+  // node `k` are `2k` and `2k + 1`, and the descendants of `k` that are
+  // `log2(kEytzingerBlock)` levels down fill one cache line.
+  void BuildEytzingerLayout() {
+    eytzinger_keys_.resize(segments_.size() + 1);
+    eytzinger_ranks_.resize(segments_.size() + 1);
+    eytzinger_keys_[0] = max_key_;
+    eytzinger_ranks_[0] = segments_.size();
+    FillEytzingerLayout(0, 1);
+  }
+
+  // Fills the subtree at node `k` with the keys from `rank` on, in order,
+  // and returns the rank of the first key past it.
+  size_t FillEytzingerLayout(size_t rank, const size_t k) {
+    if (k < eytzinger_keys_.size()) {
+      rank = FillEytzingerLayout(rank, 2 * k);
+      eytzinger_keys_[k] = spline_keys_[rank];
+      eytzinger_ranks_[k] = rank++;
+      rank = FillEytzingerLayout(rank, 2 * k + 1);
+    }
+    return rank;
+  }
+
+  // Returns the index of the first spline point not below `key`, the same
+  // as a binary search over all of them. The descent is branchless and the
+  // keys `log2(kEytzingerBlock)` levels down are prefetched, so at most one
+  // cache miss is waited for at a time, and mostly none.
+  size_t SearchEytzinger(const KeyType key) const {
+    const KeyType* keys = eytzinger_keys_.data();
+    const size_t size = eytzinger_keys_.size();
+
+    size_t k = 1;
+    while (k < size) {
+      __builtin_prefetch(keys + k * kEytzingerBlock);
+      k = 2 * k + (keys[k] < key);
+    }
+    // Go back up past the right turns to the last left turn, the answer.
+    k >>= __builtin_ffsl(~k);
+    return eytzinger_ranks_[k];
+  }
+
+  // Returns the bucket of `key` from the segment that ends at `index`.
+  size_t Interpolate(const KeyType key, const size_t index) const {
+    const BucketSegment& down = buckets_[index - 1];
+
+    const uint64_t key_diff = key - spline_keys_[index - 1];
+    const size_t bucket =
+        (down.base + (uint64_t)(((unsigned __int128)key_diff * down.mult) >>
+                                down.shift)) >>
+        32;
+    return (bucket < num_buckets_) ? bucket : num_buckets_ - 1;
+  }
+
+  // Computes the radix prefixes of `n` keys, a vector of keys at a time if
+  // possible. Keys out of [min_key_, max_key_] get meaningless prefixes.
+  void GetPrefixes(const KeyType* keys, size_t n, KeyType* prefixes) const {
+    size_t i = 0;
+#if defined(__AVX512F__)
+    if (sizeof(KeyType) == sizeof(uint64_t)) {
+      const __m512i min = _mm512_set1_epi64((long long)min_key_);
+      const __m128i shift = _mm_cvtsi64_si128((long long)num_shift_bits_);
+      for (; i + 8 <= n; i += 8) {
+        const __m512i key = _mm512_loadu_si512(keys + i);
+        _mm512_storeu_si512(prefixes + i,
+                            _mm512_srl_epi64(_mm512_sub_epi64(key, min), shift));
+      }
+    }
+#elif defined(__AVX2__)
+    if (sizeof(KeyType) == sizeof(uint64_t)) {
+      const __m256i min = _mm256_set1_epi64x((long long)min_key_);
+      const __m128i shift = _mm_cvtsi64_si128((long long)num_shift_bits_);
+      for (; i + 4 <= n; i += 4) {
+        const __m256i key =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(prefixes + i),
+                            _mm256_srl_epi64(_mm256_sub_epi64(key, min), shift));
+      }
+    }
+#endif
+    for (; i < n; ++i) prefixes[i] = (keys[i] - min_key_) >> num_shift_bits_;
+  }
+
   // Returns the index of the spline point that marks the end of the spline
   // segment that contains the `key`: `key` ∈ (spline[index - 1], spline[index]]
   size_t GetSplineSegment(const KeyType key) const {
     // Narrow search range using radix table.
     const KeyType prefix = (key - min_key_) >> num_shift_bits_;
     assert(prefix + 1 < radix_table_.size());
-    const uint32_t begin = radix_table_[prefix];
-    const uint32_t end = radix_table_[prefix + 1];
+    return SearchSplineSegment(key, radix_table_[prefix],
+                               radix_table_[prefix + 1]);
+  }
+
+  // Same as `GetSplineSegment`, within the range [begin, end] the radix
+  // table gives for `key`. Neither search branches on the keys, so skewed
+  // data does not cost mispredictions.
+  size_t SearchSplineSegment(const KeyType key, const uint32_t begin,
+                             const uint32_t end) const {
+    const KeyType* keys = spline_keys_.data();
 
     if (end - begin < 32) {
-      // Do linear search over narrowed range.
-      uint32_t current = begin;
-      while (spline_points_[current].x < key) ++current;
-      return current;
+      // Count the keys below `key` over narrowed range, a block at a time.
+      // Blocks may run past `end` into the padding: keys there are not below
+      // `key` and count for nothing.
+      size_t count = 0;
+#ifdef __AVX2__
+      if (sizeof(KeyType) == sizeof(uint64_t)) {
+        // AVX2 only compares signed integers: flip the sign bits first.
+        const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+        const __m256i target =
+            _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+        for (uint32_t current = begin; current < end; current += kPadding) {
+          const __m256i x = _mm256_xor_si256(
+              _mm256_loadu_si256(
+                  reinterpret_cast<const __m256i*>(keys + current)),
+              sign);
+          count += __builtin_popcount(_mm256_movemask_pd(
+              _mm256_castsi256_pd(_mm256_cmpgt_epi64(target, x))));
+        }
+        return begin + count;
+      }
+#endif
+      for (uint32_t current = begin; current < end; current += kPadding) {
+        count += (keys[current] < key) + (keys[current + 1] < key) +
+                 (keys[current + 2] < key) + (keys[current + 3] < key);
+      }
+      return begin + count;
     }
 
-    // Do binary search over narrowed range.
-    const auto lb = std::lower_bound(
-        spline_points_.begin() + begin, spline_points_.begin() + end, key,
-        [](const Coord<KeyType>& coord, const KeyType key) {
-          return coord.x < key;
-        });
-    return std::distance(spline_points_.begin(), lb);
+    // The Eytzinger layout finds the same point faster in large ranges.
+    if (!eytzinger_keys_.empty() && end - begin >= kEytzingerMinRange)
+      return SearchEytzinger(key);
+
+    // Do branchless binary search over narrowed range.
+    const KeyType* base = keys + begin;
+    size_t length = end - begin;
+    while (length > 1) {
+      const size_t half = length / 2;
+      base = (base[half - 1] < key) ? base + half : base;
+      length -= half;
+    }
+    return (base - keys) + (*base < key);
   }
 
   KeyType min_key_;
@@ -101,7 +379,18 @@ class RadixSpline {
   size_t max_error_;
 
   std::vector<uint32_t> radix_table_;
-  std::vector<Coord<KeyType>> spline_points_;
+  // Followed by `kPadding` copies of `max_key_`.
+  std::vector<KeyType> spline_keys_;
+  std::vector<Segment> segments_;
+
+  // Set by `SetNumBuckets`, which deserialized splines need as well.
+  size_t num_buckets_ = 0;
+  std::vector<BucketSegment> buckets_;
+
+  // Empty without the Eytzinger layout. Entry 0 stands for no spline point
+  // at all, past the last.
+  std::vector<KeyType, CacheLineAllocator<KeyType>> eytzinger_keys_;
+  std::vector<uint32_t> eytzinger_ranks_;
 
   template <typename>
   friend class Serializer;
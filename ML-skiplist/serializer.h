@@ -32,17 +32,24 @@ class Serializer {
                    sizeof(uint32_t));
     }
 
-    // Spline points.
-    const size_t spline_points_size = rs.spline_points_.size();
+    // Spline segments.
+    const size_t spline_points_size = rs.segments_.size();
     buffer.write(reinterpret_cast<const char*>(&spline_points_size),
                  sizeof(size_t));
-    for (size_t i = 0; i < rs.spline_points_.size(); ++i) {
-      buffer.write(reinterpret_cast<const char*>(&rs.spline_points_[i].x),
+    for (size_t i = 0; i < rs.segments_.size(); ++i) {
+      buffer.write(reinterpret_cast<const char*>(&rs.spline_keys_[i]),
                    sizeof(KeyType));
-      buffer.write(reinterpret_cast<const char*>(&rs.spline_points_[i].y),
+      buffer.write(reinterpret_cast<const char*>(&rs.segments_[i].intercept),
+                   sizeof(double));
+      buffer.write(reinterpret_cast<const char*>(&rs.segments_[i].slope),
                    sizeof(double));
     }
 
+    // Layout, rebuilt from the spline keys on load.
+    const bool eytzinger_layout = !rs.eytzinger_keys_.empty();
+    buffer.write(reinterpret_cast<const char*>(&eytzinger_layout),
+                 sizeof(bool));
+
     bytes->append(buffer.str());
   }
 
@@ -67,16 +74,24 @@ class Serializer {
       in.read(reinterpret_cast<char*>(&rs.radix_table_[i]), sizeof(uint32_t));
     }
 
-    // Spline points.
+    // Spline segments.
     size_t spline_points_size;
     in.read(reinterpret_cast<char*>(&spline_points_size), sizeof(size_t));
-    rs.spline_points_.resize(spline_points_size);
-    for (int i = 0; i < rs.spline_points_.size(); ++i) {
-      in.read(reinterpret_cast<char*>(&rs.spline_points_[i].x),
-              sizeof(KeyType));
-      in.read(reinterpret_cast<char*>(&rs.spline_points_[i].y), sizeof(double));
+    rs.spline_keys_.resize(spline_points_size + RadixSpline<KeyType>::kPadding,
+                           rs.max_key_);
+    rs.segments_.resize(spline_points_size);
+    for (int i = 0; i < rs.segments_.size(); ++i) {
+      in.read(reinterpret_cast<char*>(&rs.spline_keys_[i]), sizeof(KeyType));
+      in.read(reinterpret_cast<char*>(&rs.segments_[i].intercept),
+              sizeof(double));
+      in.read(reinterpret_cast<char*>(&rs.segments_[i].slope), sizeof(double));
     }
 
+    // Layout.
+    bool eytzinger_layout;
+    in.read(reinterpret_cast<char*>(&eytzinger_layout), sizeof(bool));
+    if (eytzinger_layout) rs.BuildEytzingerLayout();
+
     return rs;
   }
 };
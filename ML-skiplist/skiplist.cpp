@@ -22,8 +22,31 @@
  */
 
 #include "skiplist.h"	
+#include "builder.h"
 
-unsigned int levelmax = MAXLEVEL;
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Number of levels in use. Starts at MINLEVEL and only grows, following
+ * log2 of the set size up to MAXLEVEL (see sl_count()). Head and tail
+ * towers are allocated MAXLEVEL high, so growing needs no relinking.
+ */
+volatile AO_t levelmax = MINLEVEL;
+
+/* Per-thread generator state, so inserts on different cores share nothing */
+static __thread uint32_t rand_level_state = 2463534242UL;
+
+/*
+ * Seed the calling thread's level generator, e.g., with its thread_data_t
+ * seed. Xorshift needs a non-zero state, hence the scrambling.
+ */
+void seed_rand_level(unsigned int seed) {
+	uint32_t y = (uint32_t)seed * 2654435761UL ^ 2463534242UL;
+	rand_level_state = (y != 0) ? y : 2463534242UL;
+}
 
 /*
  * Returns a random level for inserting a new node, results are hardwired to p=0.5, min=1, max=32.
@@ -34,17 +57,15 @@ unsigned int levelmax = MAXLEVEL;
  * Marsaglia, George, (July 2003), "Xorshift RNGs", Journal of Statistical Software 8 (14)
  */
 int get_rand_level() {
-	static uint32_t y = 2463534242UL;
+	uint32_t y = rand_level_state;
 	y^=(y<<13);
 	y^=(y>>17);
 	y^=(y<<5);
-	uint32_t temp = y;
-	uint32_t level = 1;
-	while (((temp >>= 1) & 1) != 0) {
-		++level;
-	}
+	rand_level_state = y;
+	/* One level per consecutive set bit above bit 0: P(level >= l) = 2^-(l-1) */
+	uint32_t level = 1 + __builtin_ctz(~(y >> 1));
 	/* 1 <= level <= levelmax */
-	if (level > levelmax) {
+	if (level > (uint32_t)levelmax) {
 		return (int)levelmax;
 	} else {
 		return (int)level;
@@ -67,15 +88,12 @@ int floor_log_2(unsigned int n) {
 sl_node_t *sl_new_simple_node(val_t val, int toplevel, int transactional)
 {
   sl_node_t *node;
-  node = (sl_node_t *)malloc(sizeof(sl_node_t) + toplevel * sizeof(sl_node_t *));
-  if (node == NULL) {
-    perror("malloc");
-    exit(1);
-    }
+  node = (sl_node_t *)arena_alloc(SL_NODE_SIZE(toplevel));
 
   node->val = val;
   node->toplevel = toplevel;
-  node->deleted = 0;
+  node->state = 0;
+  node->refs = 0;
 
   return node;
 }
@@ -91,7 +109,7 @@ sl_node_t *sl_new_node(val_t val, sl_node_t *next, int toplevel, int transaction
 
   node = sl_new_simple_node(val, toplevel, transactional);
 
-  for (i = 0; i < levelmax; i++)
+  for (i = 0; i < toplevel; i++)
     node->next[i] = next;
 	
   return node;
@@ -99,7 +117,56 @@ sl_node_t *sl_new_node(val_t val, sl_node_t *next, int toplevel, int transaction
 
 void sl_delete_node(sl_node_t *n)
 {
-  free(n);
+  arena_free(n, SL_NODE_SIZE(n->toplevel));
+}
+
+static void sl_free_node(void *n)
+{
+  sl_delete_node((sl_node_t *)n);
+}
+
+/*
+ * Shift tables count references: a node knows how many buckets of all the
+ * shift tables refer to it, and is only retired once its remover unlinked
+ * it and no bucket refers to it anymore, by whoever gets there last. The
+ * entries of a table are thus never freed under it, even if removed.
+ */
+
+/* Add n references to node. Fails if it may already be retired */
+static inline int sl_ref_node(sl_node_t *node, unsigned int n)
+{
+  unsigned int refs;
+
+  do {
+    refs = node->refs;
+    if (refs == SL_REF_UNLINKED)
+      return 0;
+  } while (!AO_int_compare_and_swap_full(&node->refs, refs, refs + n));
+  return 1;
+}
+
+/* Drop n references to node, and retire it if it was the last ones */
+static inline void sl_unref_node(sl_node_t *node, unsigned int n)
+{
+  unsigned int refs;
+
+  do {
+    refs = node->refs;
+  } while (!AO_int_compare_and_swap_full(&node->refs, refs, refs - n));
+  if (refs - n == SL_REF_UNLINKED)
+    epoch_retire(node, sl_free_node);
+}
+
+/* Add n references to node if it is not removed. Returns 1 on success */
+static inline int sl_ref_live(sl_node_t *node, unsigned int n)
+{
+  if (!sl_ref_node(node, n))
+    return 0;
+  if (node->state & SL_DELETED) {
+    sl_unref_node(node, n);
+    return 0;
+  }
+  return 1;
 }
 
 sl_intset_t *sl_set_new()
@@ -111,9 +178,11 @@ sl_intset_t *sl_set_new()
     perror("malloc");
     exit(1);
   }
-  max = sl_new_node(VAL_MAX, NULL, levelmax, 0);
-  min = sl_new_node(VAL_MIN, max, levelmax, 0);
+  max = sl_new_node(VAL_MAX, NULL, MAXLEVEL, 0);
+  min = sl_new_node(VAL_MIN, max, MAXLEVEL, 0);
   set->head = min;
+  set->size = 0;
+  set->index = NULL;
   return set;
 }
 
@@ -121,6 +190,9 @@ void sl_set_delete(sl_intset_t *set)
 {
   sl_node_t *node, *next;
 
+  /* The index drops its references to the nodes first */
+  if (set->index != NULL)
+    sl_index_delete(set->index);
   node = set->head;
   while (node != NULL) {
     next = node->next[0];
@@ -130,6 +202,26 @@ void sl_set_delete(sl_intset_t *set)
   free(set);
 }
 
+/* Keys added minus keys removed by this thread and not yet in set->size */
+static __thread long size_delta = 0;
+
+/*
+ * Account for delta keys added (or removed), and raise levelmax once the
+ * set outgrows 2^levelmax keys.
+ */
+static void sl_count(sl_intset_t *set, long delta)
+{
+  AO_t size, max;
+
+  size_delta += delta;
+  if (size_delta > -SL_COUNT_BATCH && size_delta < SL_COUNT_BATCH)
+    return;
+  size = AO_fetch_and_add_full(&set->size, (AO_t)size_delta) + size_delta;
+  size_delta = 0;
+  while ((max = levelmax) < MAXLEVEL && ((AO_t)1 << max) < size)
+    ATOMIC_CAS_MB(&levelmax, max, max + 1);
+}
+
 unsigned long sl_set_size(sl_intset_t *set)
 {
   unsigned long size = 0;
@@ -137,97 +229,881 @@ unsigned long sl_set_size(sl_intset_t *set)
 
   node = set->head->next[0];
   while (node->next[0] != NULL) {
-    if (!node->deleted)
+    if (!(node->state & SL_DELETED))
+      size++;
+    node = node->next[0];
+  }
+
+  return size;
+}
+
+inline int is_marked(uintptr_t i) {
+  return (int)(i & (uintptr_t)0x01);
+}
+
+inline uintptr_t unset_mark(uintptr_t i) {
+  return (i & ~(uintptr_t)0x01);
+}
+
+inline uintptr_t set_mark(uintptr_t i) {
+  return (i | (uintptr_t)0x01);
+}
+
+/*
+ * Whether node holds val. The tail stores VAL_MAX, which may also be a key,
+ * so a match there also requires a successor.
+ */
+static inline int sl_match(sl_node_t *node, val_t val) {
+  return node->val == val && (val != VAL_MAX || node->next[0] != NULL);
+}
+
+/*
+ * Count the live nodes of each height: hist[l] is the number of nodes with
+ * toplevel l, for 1 <= l <= MAXLEVEL. Returns the number of nodes counted.
+ */
+unsigned long sl_level_histogram(sl_intset_t *set, unsigned long *hist)
+{
+  unsigned long size = 0;
+  sl_node_t *node;
+  int l;
+
+  for (l = 0; l <= MAXLEVEL; l++)
+    hist[l] = 0;
+  node = set->head->next[0];
+  while (node->next[0] != NULL) {
+    if (!(node->state & SL_DELETED)) {
+      hist[node->toplevel]++;
       size++;
+    }
     node = node->next[0];
   }
 
   return size;
 }
 
-shift_node_t *new_shift_table(int table_size) {
-  shift_node_t *shift_table = (shift_node_t *) malloc((table_size) * sizeof(shift_node_t));
-  for (int i = 0; i < table_size; i++) {
-    shift_table[i].count = 0;
-    shift_table[i].delta = INT_MAX;
-    shift_table[i].node = NULL;
+/* Empty groups for nb_buckets buckets */
+static shift_group_t *new_shift_groups(size_t nb_buckets) {
+  size_t nb_groups = (nb_buckets + SHIFT_GROUP - 1) / SHIFT_GROUP;
+  shift_group_t *groups;
+
+  if (posix_memalign((void **)&groups, 64, nb_groups * sizeof(shift_group_t)) != 0) {
+    fprintf(stderr, "Error allocating the shift table\n");
+    exit(1);
+  }
+  for (size_t g = 0; g < nb_groups; g++) {
+    for (int i = 0; i < SHIFT_GROUP; i++) {
+      groups[g].key[i] = ~(shift_key_t)0;
+      groups[g].node[i] = 0;
+#ifndef SHIFT_COMPACT
+      groups[g].count[i] = 0;
+      groups[g].delta[i] = INT32_MAX;
+#endif
+    }
+#ifdef SHIFT_COMPACT
+    groups[g].base = 0;
+    groups[g].shift = 0;
+#endif
+  }
+  return groups;
+}
+
+shift_table_t new_shift_table(size_t table_size) {
+#ifdef SHIFT_REGIONS
+  size_t nb_regions = (table_size + SHIFT_REGION - 1) / SHIFT_REGION;
+  shift_table_t shift_table;
+
+  shift_table.base = 0;
+  if ((shift_table.region = (shift_group_t **)malloc(nb_regions * sizeof(shift_group_t *))) == NULL) {
+    perror("malloc");
+    exit(1);
   }
+  for (size_t r = 0; r < nb_regions; r++)
+    shift_table.region[r] = new_shift_groups(SHIFT_REGION);
   return shift_table;
+#else
+  return new_shift_groups(table_size);
+#endif
 }
 
-void populate_shift_table(sl_intset_t *set, shift_node_t *shift_table, RadixSpline<val_t> *spline, int table_size) {
-  sl_node_t *node = set->head;
-  int j = 0;
+void delete_shift_table(shift_table_t shift_table, size_t table_size) {
+#ifdef SHIFT_REGIONS
+  for (size_t r = 0; r < (table_size + SHIFT_REGION - 1) / SHIFT_REGION; r++)
+    free(shift_table.region[r]);
+  free(shift_table.region);
+#else
+  free(shift_table);
+#endif
+}
+
+/*
+ * Bucket of val: its estimated position, scaled to the table. The spline
+ * computes it in fixed point, once trained for table_size buckets.
+ */
+static inline long shift_bucket(RadixSpline<val_t> *spline, val_t val, size_t table_size) {
+  assert(spline->GetNumBuckets() == table_size);
+  return (long)spline->GetBucket(val);
+}
+
+/*
+ * Key of an entry as stored in group: the key itself, or with SHIFT_COMPACT
+ * its offset from the base of the group, in units of 2^shift, which only
+ * preserves the order of keys that are far enough apart. Keys out of the
+ * range of the group share the end offsets.
+ */
+static inline shift_key_t shift_key(const shift_group_t *group, val_t val)
+{
+#ifdef SHIFT_COMPACT
+  val_t offset;
+
+  if (val <= group->base)
+    return 0;
+  offset = (val - group->base) >> group->shift;
+  return (offset > UINT16_MAX) ? UINT16_MAX : (shift_key_t)offset;
+#else
+  return val;
+#endif
+}
+
+#ifdef SHIFT_COMPACT
+/*
+ * Buckets 0 to last of group whose entry may be before a key of offset key:
+ * bit i is set if the offset of bucket i is not larger.
+ */
+static inline unsigned int shift_match(const shift_group_t *group, shift_key_t key, int last)
+{
+  unsigned int match;
+#ifdef __SSE2__
+  /* SSE2 only compares signed words: flip the sign bits first */
+  const __m128i sign = _mm_set1_epi16((short)0x8000);
+  __m128i keys = _mm_xor_si128(_mm_load_si128((const __m128i *)group->key), sign);
+  __m128i above = _mm_cmpgt_epi16(keys, _mm_xor_si128(_mm_set1_epi16((short)key), sign));
+
+  match = ~_mm_movemask_epi8(_mm_packs_epi16(above, _mm_setzero_si128())) & 0xFF;
+#else
+  match = 0;
+  for (int i = 0; i < SHIFT_GROUP; i++)
+    if (group->key[i] <= key)
+      match |= 1U << i;
+#endif
+  return match & ((2U << last) - 1);
+}
+#endif
+
+/*
+ * Start loading what a search from bucket k reads: the keys and nodes of its
+ * group, which are apart unless SHIFT_COMPACT, and the keys of the previous
+ * group, which it steps back to if the bucket was empty.
+ */
+static inline void shift_prefetch(sl_index_t *index, long k)
+{
+  __builtin_prefetch(&SHIFT_KEY(index->shift_table, k));
+#ifndef SHIFT_COMPACT
+  __builtin_prefetch(&SHIFT_AT(index->shift_table, k).node[k % SHIFT_GROUP]);
+#endif
+  if (k % SHIFT_GROUP == 0 && k > 0)
+    __builtin_prefetch(&SHIFT_KEY(index->shift_table, k - 1));
+}
+
+/*
+ * Account for the node of rank j in bucket k. Keys arrive in order, so the
+ * first one is the entry point of the bucket. Counts and deltas saturate at
+ * 32 bits, so they take 8 of the 24 bytes of an entry even on sets of
+ * billions of keys. Entry keys are set once the table is complete, by
+ * pin_shift_table().
+ *
+ * With SHIFT_TALLEST, the entry point is instead the tallest node of the
+ * bucket (the first one among equals), so that searches descend from a high
+ * level rather than walking level 0 from a short node.
+ */
+static inline void shift_table_add(shift_table_t shift_table, sl_node_t *node, size_t j, long k) {
+#ifdef SHIFT_TALLEST
+  if (SHIFT_EMPTY(shift_table, k) || node->toplevel > SHIFT_NODE(shift_table, k)->toplevel) {
+#else
+  if (SHIFT_EMPTY(shift_table, k)) {
+#endif
+#ifndef SHIFT_COMPACT
+    int64_t delta = (int64_t)j - k;
+    SHIFT_DELTA(shift_table, k) = (delta > INT32_MAX) ? INT32_MAX : (delta < INT32_MIN) ? INT32_MIN : (int32_t)delta;
+#endif
+    SHIFT_SET_NODE(shift_table, k, node);
+  }
+#ifndef SHIFT_COMPACT
+  if (SHIFT_COUNT(shift_table, k) != UINT32_MAX)
+    SHIFT_COUNT(shift_table, k)++;
+#endif
+}
+
+/*
+ * Complete buckets lo to hi-1 once their keys were added: put prev, a node
+ * before the range (the head at the start of the table), in the first bucket
+ * if no key maps there, the tail in the last bucket of the table, and point
+ * every empty bucket to the previous non-empty one.
+ *
+ * The entry of an empty bucket is then below all the keys that map there,
+ * and a search for a key below the entry of its own bucket steps back once:
+ * the start bucket is found in O(1) however many buckets a burst of inserts
+ * or removes left empty.
+ */
+static void finish_shift_table(shift_table_t shift_table, long lo, long hi, size_t table_size,
+                               sl_node_t *prev, sl_node_t *tail) {
+  long j;
 
   //put head at index 0
-  shift_table[0].node = node;
-  shift_table[0].count = 1;
-  shift_table[0].delta = 0;
+  if (SHIFT_EMPTY(shift_table, lo)) {
+    SHIFT_SET_NODE(shift_table, lo, prev);
+#ifndef SHIFT_COMPACT
+    SHIFT_COUNT(shift_table, lo) = 1;
+    SHIFT_DELTA(shift_table, lo) = 0;
+#endif
+  }
 
-  while (node->next[0]->next[0] != NULL) {
-    node = node->next[0];
-    // if (node->toplevel != levelmax)
-    //   continue;
-    int k = spline->GetEstimatedPosition(node->val) * (table_size-1);
-    int delta = j - k;
-    if (delta <= shift_table[k].delta) {
-      shift_table[k].delta = delta;
-      shift_table[k].node = node;
+  //put tail at index table_size-1
+  if (hi == (long)table_size) {
+    SHIFT_SET_NODE(shift_table, hi-1, tail);
+#ifndef SHIFT_COMPACT
+    SHIFT_COUNT(shift_table, hi-1) = 1;
+    SHIFT_DELTA(shift_table, hi-1) = 0;
+#endif
+  }
+
+
+  for (j = lo+1; j < hi; j++) {
+    if (SHIFT_EMPTY(shift_table, j)) {
+      SHIFT_SET_NODE(shift_table, j, SHIFT_NODE(shift_table, j-1));
+#ifndef SHIFT_COMPACT
+      SHIFT_COUNT(shift_table, j) = SHIFT_COUNT(shift_table, j-1);
+      SHIFT_DELTA(shift_table, j) = SHIFT_DELTA(shift_table, j-1) - (SHIFT_DELTA(shift_table, j-1) != INT32_MIN);
+#endif
     }
-    shift_table[k].count++;
+  }
+}
+
+void populate_shift_table(sl_intset_t *set, shift_table_t shift_table, RadixSpline<val_t> *spline, size_t table_size) {
+  sl_node_t *node = set->head;
+  sl_node_t *next;
+  size_t j = 0;
+
+  /* The set may be updated concurrently: step over marks and deleted nodes */
+  next = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+  while (next->next[0] != NULL) {
+    node = next;
+    next = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+    if (node->state & SL_DELETED)
+      continue;
+    long k = shift_bucket(spline, node->val, table_size);
+    shift_table_add(shift_table, node, j, k);
     j++;
   }
 
-  //put tail at index table_size-1
-  shift_table[table_size-1].node = node->next[0];
-  shift_table[table_size-1].count = 1;
-  shift_table[table_size-1].delta = 0;
+  finish_shift_table(shift_table, 0, table_size, table_size, set->head, next);
+}
 
+/*
+ * Take the references of buckets lo to hi-1 of a shift table of set to their
+ * nodes, a run of buckets with the same node at a time. A node that was
+ * removed before it could be referenced is replaced by the entry of the
+ * previous bucket, or for the first one by prev, a node before the range,
+ * or by the head if prev was removed too. Also sets the entry keys and, with
+ * SHIFT_COMPACT, the base of their groups. Must run in the same epoch
+ * section as populate_shift_table().
+ */
+static void pin_shift_table(sl_intset_t *set, shift_table_t shift_table, long lo, long hi,
+                            sl_node_t *prev)
+{
+  sl_node_t *node, *pinned = NULL;
+  shift_group_t *group;
+  long j, g, end;
+#ifdef SHIFT_COMPACT
+  val_t range;
+#endif
 
-  for (j = table_size-1; j >= 0; j--) {
-    if (shift_table[j].count == 0) {
-      shift_table[j].count = shift_table[j+1].count;
-      shift_table[j].delta = shift_table[j+1].delta+1;
-      shift_table[j].node = shift_table[j+1].node;
+  for (j = lo; j < hi; j = end) {
+    node = SHIFT_NODE(shift_table, j);
+    for (end = j + 1; end < hi && SHIFT_NODE(shift_table, end) == node; end++)
+      ;
+    if (sl_ref_live(node, end - j))
+      ;
+    else if (j == lo && sl_ref_live(prev, end - j))
+      node = prev;
+    else {
+      node = (j == lo) ? set->head : pinned;
+      sl_ref_node(node, end - j);
     }
+    pinned = node;
+    for (; j < end; j++)
+      SHIFT_SET_NODE(shift_table, j, pinned);
+  }
+
+  /* lo is the first bucket of a group */
+  for (g = lo; g < hi; g += SHIFT_GROUP) {
+    group = &SHIFT_AT(shift_table, g);
+#ifdef SHIFT_COMPACT
+    /* Spread the offsets over the entries of the group, short of the tail */
+    group->base = SHIFT_NODE(shift_table, g)->val;
+    range = 0;
+    for (j = g; j < g + SHIFT_GROUP && j < hi; j++) {
+      node = SHIFT_NODE(shift_table, j);
+      if (node->next[0] != NULL)
+        range = node->val - group->base;
+    }
+    group->shift = (range > UINT16_MAX) ? 48 - __builtin_clzl(range) : 0;
+#endif
+    for (j = g; j < g + SHIFT_GROUP && j < hi; j++)
+      SHIFT_KEY(shift_table, j) = shift_key(group, SHIFT_NODE(shift_table, j)->val);
   }
 }
 
-inline int is_marked(uintptr_t i) {
-  return (int)(i & (uintptr_t)0x01);
+/*
+ * First node whose key is not smaller than val, or a node inserted right
+ * before it if the set is being updated. Runs in an epoch section.
+ */
+static sl_node_t *sl_seek(sl_intset_t *set, val_t val)
+{
+  sl_node_t *node, *next;
+  int i;
+
+  node = set->head;
+  for (i = levelmax-1; i >= 0; i--) {
+    next = (sl_node_t *)unset_mark((uintptr_t)node->next[i]);
+    while (next->val < val) {
+      node = next;
+      next = (sl_node_t *)unset_mark((uintptr_t)node->next[i]);
+    }
+  }
+  return (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
 }
 
-inline uintptr_t unset_mark(uintptr_t i) {
-  return (i & ~(uintptr_t)0x01);
+/* Share of an index build handled by one thread */
+typedef struct sl_part {
+  sl_intset_t *set;
+  sl_index_t *index;
+  const val_t *keys;
+  size_t n;
+  size_t lo, hi;                        /* ranks of the keys of the part */
+  val_t min, max;                       /* key range of the part, when collecting */
+  std::vector<val_t> found;
+  Builder<val_t> *builder;
+  pthread_t thread;
+} sl_part_t;
+
+/* Split the n keys in parts of consecutive ranks */
+static sl_part_t *sl_new_parts(sl_intset_t *set, const val_t *keys, size_t n, int nb_parts)
+{
+  sl_part_t *parts = new sl_part_t[nb_parts];
+  int t;
+
+  for (t = 0; t < nb_parts; t++) {
+    parts[t].set = set;
+    parts[t].index = NULL;
+    parts[t].keys = keys;
+    parts[t].n = n;
+    parts[t].lo = n * t / nb_parts;
+    parts[t].hi = n * (t + 1) / nb_parts;
+    parts[t].builder = NULL;
+  }
+  return parts;
 }
 
-inline uintptr_t set_mark(uintptr_t i) {
-  return (i | (uintptr_t)0x01);
+/* Run fn on every part, one thread each */
+static void sl_run_parts(sl_part_t *parts, int nb_parts, void *(*fn)(void *))
+{
+  int t;
+
+  for (t = 0; t < nb_parts; t++) {
+    if (pthread_create(&parts[t].thread, NULL, fn, &parts[t]) != 0) {
+      fprintf(stderr, "Error creating thread\n");
+      exit(1);
+    }
+  }
+  for (t = 0; t < nb_parts; t++) {
+    if (pthread_join(parts[t].thread, NULL) != 0) {
+      fprintf(stderr, "Error waiting for thread completion\n");
+      exit(1);
+    }
+  }
 }
 
-inline void fraser_search(sl_intset_t *set, 
-                          val_t val, 
-                          sl_node_t **left_list, 
-                          sl_node_t **right_list,
-                          RadixSpline<val_t> *spline, 
-                          shift_node_t *shift_table, 
-                          int table_size, 
-                          unsigned long *iterations) {
-  int i;
-  sl_node_t *left, *left_next, *right, *right_next;
+/*
+ * Part threads are short-lived and never retire anything, so they are not
+ * registered with the epochs: they run inside the epoch section of the
+ * thread that started them, which joins them before it leaves it.
+ */
+
+/* Collect the distinct live keys in [min, max) */
+static void *sl_part_collect(void *arg)
+{
+  sl_part_t *p = (sl_part_t *)arg;
+  sl_node_t *node;
+
+  node = sl_seek(p->set, p->min);
+  while (node->next[0] != NULL && node->val < p->max) {
+    if (!(node->state & SL_DELETED) && (p->found.empty() || p->found.back() < node->val))
+      p->found.push_back(node->val);
+    node = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+  }
+  return NULL;
+}
+
+/* Train the piece of the spline over the keys of the part */
+static void *sl_part_train(void *arg)
+{
+  sl_part_t *p = (sl_part_t *)arg;
+  size_t i;
+
+  /* One radix bit: the radix table of a piece is not used */
+  p->builder = new Builder<val_t>(p->keys[p->lo], p->keys[p->hi-1], 1,
+                                  SPLINE_MAX_ERROR);
+  for (i = p->lo; i < p->hi; i++)
+    p->builder->AddKey(p->keys[i], i);
+  return NULL;
+}
+
+/*
+ * Map the nodes of the part into the shift table. A part fills the buckets
+ * after the one of the key before it, up to the one of its last key (or to
+ * the end of the table), so each bucket is filled by a single thread and in
+ * key order, even for keys added since the keys were collected.
+ */
+static void *sl_part_fill(void *arg)
+{
+  sl_part_t *p = (sl_part_t *)arg;
+  shift_table_t shift_table = p->index->shift_table;
+  RadixSpline<val_t> *spline = p->index->spline;
+  size_t table_size = p->index->table_size;
+  sl_node_t *node;
+  long k, first = 0, last = table_size - 1;
+  size_t j = 0;
+
+  if (p->hi < p->n)
+    last = shift_bucket(spline, p->keys[p->hi-1], table_size);
+  if (p->lo > 0) {
+    first = shift_bucket(spline, p->keys[p->lo-1], table_size) + 1;
+    node = sl_seek(p->set, p->keys[p->lo-1]);
+    j = p->lo - 1;
+  } else {
+    node = (sl_node_t *)unset_mark((uintptr_t)p->set->head->next[0]);
+  }
+  while (node->next[0] != NULL) {
+    if (!(node->state & SL_DELETED)) {
+      k = shift_bucket(spline, node->val, table_size);
+      if (k > last)
+        break;
+      if (k >= first)
+        shift_table_add(shift_table, node, j, k);
+      j++;
+    }
+    node = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+  }
+  return NULL;
+}
+
+/*
+ * Train a spline on n sorted distinct keys. With several threads, each one
+ * trains the piece over a range of keys and the pieces are stitched, which
+ * keeps the error bound of a single pass; requires n >= 2 * nb_threads.
+ */
+static RadixSpline<val_t> *sl_train(const val_t *keys, size_t n, int nb_threads)
+{
+  Builder<val_t> builder(keys[0], keys[n-1], SPLINE_RADIX_BITS,
+                         SPLINE_MAX_ERROR, SPLINE_LAYOUT);
+  sl_part_t *parts;
+  int t;
+
+  if (nb_threads <= 1) {
+    for (size_t i = 0; i < n; i++)
+      builder.AddKey(keys[i]);
+    return builder.Finalize();
+  }
+
+  parts = sl_new_parts(NULL, keys, n, nb_threads);
+  sl_run_parts(parts, nb_threads, sl_part_train);
+  for (t = 0; t < nb_threads; t++) {
+    builder.Append(*parts[t].builder);
+    delete parts[t].builder;
+  }
+  delete[] parts;
+  return builder.Finalize();
+}
+
+/*
+ * Wrap a trained spline into a new index: fill the shift table from the
+ * current content of the set and pin the nodes it references. With several
+ * threads, each one fills the buckets of a range of the n sorted keys the
+ * spline was trained on; the set may have changed since.
+ */
+static sl_index_t *sl_index_build(sl_intset_t *set, RadixSpline<val_t> *spline, size_t table_size,
+                                  const val_t *keys, size_t n, int nb_threads)
+{
+  sl_index_t *index;
+  sl_node_t *tail;
+  sl_part_t *parts;
+  int t;
+
+  if ((index = (sl_index_t *)malloc(sizeof(sl_index_t))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  index->spline = spline;
+  index->spline->SetNumBuckets(table_size);
+  index->table_size = table_size;
+  index->shift_table = new_shift_table(table_size);
+  /* Also keeps the nodes found by the threads alive until they are referenced */
+  epoch_enter();
+  if (nb_threads <= 1) {
+    populate_shift_table(set, index->shift_table, index->spline, table_size);
+  } else {
+    parts = sl_new_parts(set, keys, n, nb_threads);
+    for (t = 0; t < nb_threads; t++)
+      parts[t].index = index;
+    sl_run_parts(parts, nb_threads, sl_part_fill);
+    delete[] parts;
+    tail = sl_seek(set, VAL_MAX);
+    while (tail->next[0] != NULL)
+      tail = (sl_node_t *)unset_mark((uintptr_t)tail->next[0]);
+    finish_shift_table(index->shift_table, 0, table_size, table_size, set->head, tail);
+  }
+  pin_shift_table(set, index->shift_table, 0, table_size, set->head);
+  epoch_exit();
+
+  return index;
+}
+
+/*
+ * Build a new index (spline and shift table) from the current content of
+ * the set, with nb_threads threads. Safe to call while other threads operate
+ * on the set; returns NULL if the set holds fewer than two keys. The keys
+ * are collected in parallel once the set has an index, whose entries split
+ * them in ranges of about the same size.
+ */
+sl_index_t *sl_index_new(sl_intset_t *set, size_t table_size, int nb_threads)
+{
+  sl_index_t *cur;
+  sl_part_t *parts;
+  std::vector<val_t> keys;
+  val_t min;
+  int t;
+
+  parts = new sl_part_t[nb_threads];
+  epoch_enter();
+  cur = set->index;
+  min = VAL_MIN;
+  for (t = 0; t < nb_threads; t++) {
+    parts[t].set = set;
+    parts[t].min = min;
+    if (t + 1 < nb_threads && cur != NULL) {
+      /* Entries may lag behind removals, but never go down */
+      min = SHIFT_NODE(cur->shift_table, cur->table_size * (t + 1) / nb_threads)->val;
+      if (min < parts[t].min)
+        min = parts[t].min;
+    } else {
+      min = VAL_MAX;
+    }
+    parts[t].max = min;
+  }
+  if (nb_threads > 1 && cur != NULL) {
+    sl_run_parts(parts, nb_threads, sl_part_collect);
+  } else {
+    parts[0].max = VAL_MAX;
+    sl_part_collect(&parts[0]);
+    nb_threads = 1;
+  }
+  epoch_exit();
+  for (t = 0; t < nb_threads; t++)
+    keys.insert(keys.end(), parts[t].found.begin(), parts[t].found.end());
+  delete[] parts;
+  if (keys.size() < 2)
+    return NULL;
+
+  return sl_index_new_par(set, keys.data(), keys.size(), table_size, nb_threads);
+}
+
+/*
+ * Build a new index from n sorted distinct keys that the set held when the
+ * call started, with nb_threads threads: they train pieces of the spline
+ * over ranges of the keys, then fill the matching ranges of the shift table.
+ */
+sl_index_t *sl_index_new_par(sl_intset_t *set, const val_t *keys, size_t n, size_t table_size, int nb_threads)
+{
+  if (n < 2)
+    return NULL;
+  if ((size_t)nb_threads > n / 2)
+    nb_threads = n / 2;
+
+  return sl_index_build(set, sl_train(keys, n, nb_threads), table_size, keys, n, nb_threads);
+}
+
+/*
+ * Drop the references of buckets lo to hi-1 of a shift table that no
+ * operation can reach anymore.
+ */
+static void unpin_shift_table(shift_table_t shift_table, long lo, long hi)
+{
+  sl_node_t *node;
+  long j, end;
+
+  for (j = lo; j < hi; j = end) {
+    node = SHIFT_NODE(shift_table, j);
+    for (end = j + 1; end < hi && SHIFT_NODE(shift_table, end) == node; end++)
+      ;
+    sl_unref_node(node, end - j);
+  }
+}
+
+void sl_index_delete(sl_index_t *index)
+{
+  unpin_shift_table(index->shift_table, 0, index->table_size);
+  delete index->spline;
+  delete_shift_table(index->shift_table, index->table_size);
+  free(index);
+}
+
+/*
+ * Retrain the index on the current keys and publish it with a single pointer
+ * swap. Operations never wait: those still running on the old index finish
+ * on it, and it is only freed after a grace period. Returns 0 if the set is
+ * too small to train on, in which case the current index is kept.
+ */
+int sl_retrain(sl_intset_t *set, size_t table_size, int nb_threads)
+{
+  sl_index_t *index, *old;
+
+  if ((index = sl_index_new(set, table_size, nb_threads)) == NULL)
+    return 0;
+  do {
+    old = set->index;
+  } while (!ATOMIC_CAS_MB(&set->index, old, index));
+  if (old != NULL) {
+    epoch_synchronize();
+    sl_index_delete(old);
+  }
+  return 1;
+}
+
+#ifdef SHIFT_REGIONS
+/*
+ * Rebuild region r of the shift table of index from the current content of
+ * the set, aside, and swap it in. The ranks of the keys in the set are not
+ * known, so deltas count from the start of the region. Returns the old
+ * region. Runs in an epoch section.
+ */
+static shift_group_t *sl_refresh_region(sl_intset_t *set, sl_index_t *index, size_t r)
+{
+  shift_table_t view;
+  shift_group_t *region, *old;
+  sl_node_t *node, *next, *prev;
+  long lo = r * SHIFT_REGION, hi = lo + SHIFT_REGION, j, k;
+  size_t rank = lo;
+
+  if (hi > (long)index->table_size)
+    hi = index->table_size;
+  region = new_shift_groups(SHIFT_REGION);
+  view.base = lo;
+  view.region = &region;
+
+  /* Start from a live entry that maps before the region, or from the head */
+  node = set->head;
+  for (j = lo - 1; j >= 0; j--) {
+    next = SHIFT_NODE(index->shift_table, j);
+    if (!(next->state & SL_DELETED) && shift_bucket(index->spline, next->val, index->table_size) < lo) {
+      node = next;
+      break;
+    }
+  }
+
+  prev = node;
+  next = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+  while (next->next[0] != NULL) {
+    node = next;
+    next = (sl_node_t *)unset_mark((uintptr_t)node->next[0]);
+    if (node->state & SL_DELETED)
+      continue;
+    k = shift_bucket(index->spline, node->val, index->table_size);
+    if (k < lo) {
+      prev = node;
+      continue;
+    }
+    if (k >= hi)
+      break;
+    shift_table_add(view, node, rank++, k);
+  }
+
+  finish_shift_table(view, lo, hi, index->table_size, prev, next);
+  pin_shift_table(set, view, lo, hi, prev);
+  old = index->shift_table.region[r];
+  AO_store_release((volatile AO_t *)&index->shift_table.region[r], (AO_t)region);
+  return old;
+}
+
+/*
+ * Rebuild the regions of the current shift table one at a time, keeping the
+ * spline, so that a refresh takes one region of extra memory rather than a
+ * whole table. Must not run concurrently with sl_retrain(). Returns the
+ * number of regions refreshed.
+ */
+size_t sl_refresh_regions(sl_intset_t *set)
+{
+  sl_index_t *index = set->index;
+  shift_table_t view;
+  shift_group_t *old;
+  size_t r, nb_regions, hi;
+
+  if (index == NULL)
+    return 0;
+  nb_regions = (index->table_size + SHIFT_REGION - 1) / SHIFT_REGION;
+  for (r = 0; r < nb_regions; r++) {
+    epoch_enter();
+    old = sl_refresh_region(set, index, r);
+    epoch_exit();
+    epoch_synchronize();
+    view.base = r * SHIFT_REGION;
+    view.region = &old;
+    hi = (r + 1) * SHIFT_REGION;
+    unpin_shift_table(view, view.base, (hi < index->table_size) ? hi : index->table_size);
+    free(old);
+  }
+  return nb_regions;
+}
+#endif
+
+/*
+ * Build a set holding the keys of a sorted array, and its index, in time
+ * linear in n. Nodes are allocated in key order, so they sit next to each
+ * other in the arena, and towers are assigned deterministically: the i-th
+ * distinct key (from 1) gets 1 + ctz(i) levels, capped at levelmax, which is
+ * the shape random levels only approximate. The spline is trained while the
+ * nodes are linked; the shift table then takes one sweep over level 0.
+ * Duplicate keys are skipped. The index is NULL if there are fewer than two
+ * distinct keys. The set must not be shared before this returns.
+ */
+sl_intset_t *sl_set_bulk_load(const val_t *keys, size_t n, size_t table_size)
+{
+  sl_intset_t *set;
+  sl_node_t *node, *tail, *preds[MAXLEVEL];
+  Builder<val_t> *builder = NULL;
+  AO_t max;
+  size_t i, nb = 0;
+  int l, top;
+
+  set = sl_set_new();
+  tail = set->head->next[0];
+  for (l = 0; l < MAXLEVEL; l++)
+    preds[l] = set->head;
+
+  /* Size levelmax for n keys up front, as sl_count() would have */
+  while ((max = levelmax) < MAXLEVEL && ((AO_t)1 << max) < n)
+    ATOMIC_CAS_MB(&levelmax, max, max + 1);
+  top = levelmax;
+
+  if (n >= 2 && keys[0] < keys[n-1])
+    builder = new Builder<val_t>(keys[0], keys[n-1], SPLINE_RADIX_BITS,
+                                 SPLINE_MAX_ERROR, SPLINE_LAYOUT);
+  for (i = 0; i < n; i++) {
+    if (nb > 0 && keys[i] == preds[0]->val)
+      continue;
+    assert(nb == 0 || preds[0]->val < keys[i]);
+    nb++;
+    l = 1 + __builtin_ctzl(nb);
+    node = sl_new_simple_node(keys[i], (l < top) ? l : top, 0);
+    node->state = SL_LINKED;
+    for (l = 0; l < node->toplevel; l++) {
+      node->next[l] = tail;
+      preds[l]->next[l] = node;
+      preds[l] = node;
+    }
+    if (builder != NULL)
+      builder->AddKey(keys[i]);
+  }
+  set->size = nb;
+
+  if (builder != NULL) {
+    set->index = sl_index_build(set, builder->Finalize(), table_size, NULL, 0, 1);
+    delete builder;
+  }
+  return set;
+}
+
+/*
+ * Same as fraser_search(), from bucket of val in the table of index, or -1
+ * to start from the head.
+ */
+static inline void fraser_search_from(sl_intset_t *set,
+                                      val_t val,
+                                      long bucket,
+                                      sl_node_t **left_list,
+                                      sl_node_t **right_list,
+                                      sl_index_t *index,
+                                      unsigned long *iterations) {
+  int i, top;
+  long k;
+#ifdef SHIFT_COMPACT
+  shift_group_t *group;
+  unsigned int match;
+#endif
+  sl_node_t *start, *left, *left_next, *right, *right_next;
 
 retry:
 
-  int k = spline->GetEstimatedPosition(val) * (table_size-1);
-  left = (sl_node_t *) unset_mark((long) shift_table[k].node);
-  (*iterations)++;
-  while ((left->val > val && k-- > 0)) {
-    left = (sl_node_t *) unset_mark((long) shift_table[k].node);
+  /*
+   * Start from the closest live node strictly before val, or from the head,
+   * which is also where searches start before the first index is built.
+   * Buckets are skipped on their inline key; a node is only read once its
+   * key qualifies, to check that it is still in the set. With SHIFT_COMPACT,
+   * the buckets of a group are filtered at once, and equal offsets may still
+   * hide a smaller key.
+   */
+  start = set->head;
+  k = bucket;
+#ifdef SHIFT_COMPACT
+  while (k >= 0) {
     (*iterations)++;
+    group = &SHIFT_AT(index->shift_table, k);
+    match = shift_match(group, shift_key(group, val), k % SHIFT_GROUP);
+    k -= k % SHIFT_GROUP;
+    while (match != 0) {
+      i = 31 - __builtin_clz(match);
+      match &= ~(1U << i);
+      left = (sl_node_t *) unset_mark((uintptr_t) SHIFT_NODE(index->shift_table, k + i));
+      if (left->val < val && !(left->state & SL_DELETED)) {
+        start = left;
+        goto found;
+      }
+    }
+    k--;
+  }
+found:
+#else
+  for (; k >= 0; k--) {
+    (*iterations)++;
+    if (SHIFT_KEY(index->shift_table, k) >= val)
+      continue;
+    left = (sl_node_t *) unset_mark((uintptr_t) SHIFT_NODE(index->shift_table, k));
+    if (left->val < val && !(left->state & SL_DELETED)) {
+      start = left;
+      break;
+    }
   }
+#endif
+  /* Level 0 is reached last: fetch the successor of start while descending */
+  SL_PREFETCH((sl_node_t *)unset_mark((uintptr_t)start->next[0]));
   // left = (sl_node_t *) unset_mark((long) left->next);
 
-  for (i = left->toplevel - 1; i >= 0; i--) {
+  /*
+   * Predecessors are needed on every level when inserting or unlinking: take
+   * the levels above a short start node from the head, and join the start
+   * node once the search descends to its height.
+   */
+  top = levelmax;
+  if (left_list != NULL && start->toplevel < top) {
+    left = set->head;
+    i = top - 1;
+  } else {
+    left = start;
+    i = ((start->toplevel < top) ? start->toplevel : top) - 1;
+  }
+
+  for (; i >= 0; i--) {
+    if (i < start->toplevel && left->val < start->val)
+      left = start;
     left_next = left->next[i];
     if (is_marked((uintptr_t)left_next))
       goto retry;
@@ -256,6 +1132,23 @@ retry:
   }
 }
 
+inline void fraser_search(sl_intset_t *set, 
+                          val_t val, 
+                          sl_node_t **left_list, 
+                          sl_node_t **right_list,
+                          sl_index_t *index, 
+                          unsigned long *iterations) {
+  long k = -1;
+
+  if (index != NULL) {
+    k = shift_bucket(index->spline, val, index->table_size);
+#ifdef PREFETCH
+    shift_prefetch(index, k);
+#endif
+  }
+  fraser_search_from(set, val, k, left_list, right_list, index, iterations);
+}
+
 inline void mark_node_ptrs(sl_node_t *n) {
   int i;
   sl_node_t *n_next;
@@ -269,51 +1162,226 @@ inline void mark_node_ptrs(sl_node_t *n) {
   }
 }
 
+/*
+ * Incremental maintenance of a published shift table. Entries are changed
+ * with a CAS on the node pointer; the inline key is rewritten afterwards and
+ * is only a hint, as fraser_search() checks the node it starts from. The
+ * buckets that refer to a node are kept consecutive: its own bucket, then
+ * empty ones after it, so a removed node can be replaced in all of them,
+ * after which nothing keeps it from being retired.
+ */
+
+/*
+ * Replace cur by node in bucket k, unless node was removed meanwhile or the
+ * entry changed, moving the bucket's reference from cur to node. Returns 1
+ * on success.
+ */
+static int shift_table_swap(sl_index_t *index, long k, sl_node_t *cur, sl_node_t *node)
+{
+  shift_table_t shift_table = index->shift_table;
+  sl_node_t *entry;
+
+  if (!sl_ref_live(node, 1))
+    return 0;
+  if (!SHIFT_CAS_NODE(shift_table, k, cur, node)) {
+    sl_unref_node(node, 1);
+    return 0;
+  }
+  sl_unref_node(cur, 1);
+  /* Concurrent swaps race on the key: the last writer makes it match */
+  do {
+    entry = SHIFT_NODE(shift_table, k);
+    SHIFT_KEY(shift_table, k) = shift_key(&SHIFT_AT(shift_table, k), entry->val);
+    AO_nop_full();
+  } while (SHIFT_NODE(shift_table, k) != entry);
+  return 1;
+}
+
+/*
+ * Node, a key val of bucket k, was removed: replace it in bucket k, unless a
+ * better entry took its place, and in the empty buckets after k that were
+ * filled from it. A bucket takes the first node in the set from val on if
+ * it maps to the bucket or before, else the last one before val as for an
+ * empty bucket, until its entry is a live node.
+ */
+static void shift_table_repair(sl_intset_t *set, sl_index_t *index, long k, val_t val,
+                               sl_node_t *node, unsigned long *iterations)
+{
+  sl_node_t *preds[MAXLEVEL], *succs[MAXLEVEL], *cur, *next;
+  int searched = 0;
+  long j;
+
+  if (!(node->state & SL_DELETED))
+    return;
+  for (j = k; j < (long)index->table_size; j++) {
+    if (SHIFT_NODE(index->shift_table, j) != node) {
+      if (j > k)
+        break;
+      continue;
+    }
+    cur = node;
+    do {
+      if (!searched) {
+        fraser_search(set, val, preds, succs, index, iterations);
+        searched = 1;
+      }
+      next = succs[0];
+      if (next->next[0] == NULL || shift_bucket(index->spline, next->val, index->table_size) > j)
+        next = preds[0];
+      if (shift_table_swap(index, j, cur, next))
+        cur = next;
+      else
+        searched = 0;
+    } while (SHIFT_NODE(index->shift_table, j) == cur && (cur->state & SL_DELETED));
+  }
+}
+
+/*
+ * Whether node, a key of bucket k, is a better entry than cur: it comes
+ * first in the bucket (is taller with SHIFT_TALLEST). Sentinels, removed
+ * nodes and entries of another bucket, as empty buckets have, always give
+ * way.
+ */
+static inline int shift_table_better(sl_intset_t *set, sl_index_t *index, long k,
+                                     sl_node_t *node, sl_node_t *cur)
+{
+  if (cur == set->head || cur->next[0] == NULL || (cur->state & SL_DELETED))
+    return 1;
+  if (shift_bucket(index->spline, cur->val, index->table_size) != k)
+    return 1;
+#ifdef SHIFT_TALLEST
+  return node->toplevel > cur->toplevel;
+#else
+  return node->val < cur->val;
+#endif
+}
+
+/*
+ * Make a newly inserted node the entry of its bucket if it is a better one,
+ * and of the empty buckets after it that were filled from a node before it.
+ */
+static void shift_table_insert(sl_intset_t *set, sl_index_t *index, sl_node_t *node,
+                               unsigned long *iterations)
+{
+  long k = shift_bucket(index->spline, node->val, index->table_size), j;
+  sl_node_t *cur;
+
+  do {
+    cur = SHIFT_NODE(index->shift_table, k);
+    if (!shift_table_better(set, index, k, node, cur) || (node->state & SL_DELETED))
+      return;
+  } while (!shift_table_swap(index, k, cur, node));
+  if (cur->val < node->val) {
+    for (j = k + 1; j < (long)index->table_size && SHIFT_NODE(index->shift_table, j) == cur; j++)
+      if (!shift_table_swap(index, j, cur, node))
+        break;
+  }
+  /* A remover that missed the new entries leaves the repair to us */
+  shift_table_repair(set, index, k, node->val, node, iterations);
+}
+
+/*
+ * Hand a node that is unlinked on every level over to the epoch-based
+ * reclamation, or leave it to the last shift table bucket that still refers
+ * to it (see sl_unref_node()).
+ */
+static void sl_retire_node(sl_node_t *node)
+{
+  unsigned int refs;
+
+  do {
+    refs = node->refs;
+  } while (!AO_int_compare_and_swap_full(&node->refs, refs, refs | SL_REF_UNLINKED));
+  if (refs == 0)
+    epoch_retire(node, sl_free_node);
+}
+
 int sl_contains(sl_intset_t *set, 
-                RadixSpline<val_t> *spline, 
-                shift_node_t *shift_table, 
-                int table_size, 
                 val_t val, 
                 unsigned long *iterations)
 {
-  sl_node_t **succs;
+  sl_node_t *succs[MAXLEVEL];
   int result;
 
-  succs = (sl_node_t **)malloc(levelmax * sizeof(sl_node_t *));
-  fraser_search(set, val, NULL, succs, spline, shift_table, table_size, iterations);
-  result = (succs[0]->val == val && !succs[0]->deleted);
-  free(succs);
+  epoch_enter();
+  fraser_search(set, val, NULL, succs, set->index, iterations);
+  result = (sl_match(succs[0], val) && !(succs[0]->state & SL_DELETED));
+  epoch_exit();
   return result;
 }
 
+/*
+ * Look up the n keys of vals, writing 1 to found[i] if vals[i] is in the
+ * set, 0 otherwise. The spline maps a batch of keys at a time and the
+ * buckets of the batch are prefetched before any search starts, so the
+ * misses of different keys overlap. Returns the number of keys found.
+ */
+size_t sl_contains_batch(sl_intset_t *set,
+                         const val_t *vals,
+                         size_t n,
+                         int *found,
+                         unsigned long *iterations)
+{
+  sl_node_t *succs[MAXLEVEL];
+  sl_index_t *index;
+  size_t buckets[RadixSpline<val_t>::kBatchSize];
+  size_t first, count, i, nb_found = 0;
+
+  epoch_enter();
+  index = set->index;
+  for (first = 0; first < n; first += count) {
+    count = (n - first < RadixSpline<val_t>::kBatchSize) ? n - first : RadixSpline<val_t>::kBatchSize;
+    if (index != NULL) {
+      index->spline->GetBuckets(vals + first, count, buckets);
+      for (i = 0; i < count; i++)
+        shift_prefetch(index, buckets[i]);
+    }
+    for (i = 0; i < count; i++) {
+      fraser_search_from(set, vals[first + i], (index != NULL) ? (long)buckets[i] : -1,
+                         NULL, succs, index, iterations);
+      found[first + i] = (sl_match(succs[0], vals[first + i]) && !(succs[0]->state & SL_DELETED));
+      nb_found += found[first + i];
+    }
+  }
+  epoch_exit();
+  return nb_found;
+}
+
 
 int sl_add(sl_intset_t *set, 
-           RadixSpline<val_t> *spline, 
-           shift_node_t *shift_table, 
-           int table_size, val_t v, 
+           val_t v, 
            unsigned long *iterations) 
 {
-  sl_node_t *new_n, *new_next, *pred, *succ, **succs, **preds;
-  int i;
+  sl_node_t *new_n = NULL, *new_next, *pred, *succ;
+  sl_node_t *preds[MAXLEVEL], *succs[MAXLEVEL];
+  sl_index_t *index;
+  intptr_t state;
+  int i, level;
   int result;
 
-  new_n = sl_new_simple_node(v, get_rand_level(), 6);
-  preds = (sl_node_t **)malloc(levelmax * sizeof(sl_node_t *));
-  succs = (sl_node_t **)malloc(levelmax * sizeof(sl_node_t *));
+  /* Draw the level first: the search then covers every level it needs */
+  level = get_rand_level();
+  epoch_enter();
+  /* The same index serves the whole operation, even if retrained meanwhile */
+  index = set->index;
 retry: 	
-  fraser_search(set, v, preds, succs, spline, shift_table, table_size, iterations);
+  fraser_search(set, v, preds, succs, index, iterations);
   /* Update the value field of an existing node */
-  if (succs[0]->val == v) {
+  if (sl_match(succs[0], v)) {
     /* Value already in list */
-    if (succs[0]->deleted) {
+    if (succs[0]->state & SL_DELETED) {
       /* Value is deleted: remove it and retry */
       mark_node_ptrs(succs[0]);
       goto retry;
     }
     result = 0;
-    sl_delete_node(new_n);
+    if (new_n != NULL)
+      sl_delete_node(new_n);
     goto end;
   }
+  /* Only allocate once the value is known to be absent */
+  if (new_n == NULL)
+    new_n = sl_new_simple_node(v, level, 6);
   for (i = 0; i < new_n->toplevel; i++)
     new_n->next[i] = succs[i];
   /* Node is visible once inserted at lowest level */
@@ -329,59 +1397,97 @@ retry:
           (!ATOMIC_CAS_MB(&new_n->next[i], unset_mark((uintptr_t)new_next), succ)))
         break; /* Give up if pointer is marked */
       /* Check for old reference to a k node */
-      if (succ->val == v)
+      if (sl_match(succ, v))
         succ = (sl_node_t *)unset_mark((uintptr_t)succ->next);
       /* We retry the search if the CAS fails */
       if (ATOMIC_CAS_MB(&pred->next[i], succ, new_n))
         break;
-      fraser_search(set, v, preds, succs, spline, shift_table, table_size, iterations);
+      fraser_search(set, v, preds, succs, index, iterations);
     }
   }
   result = 1;
+  sl_count(set, 1);
+  /*
+   * A remover that got in while we were still linking upper levels leaves
+   * the unlinking to us: only now can no new link to the node appear.
+   */
+  do {
+    state = new_n->state;
+  } while (!ATOMIC_CAS_MB(&new_n->state, state, state | SL_LINKED));
+  if (state & SL_DELETED) {
+    mark_node_ptrs(new_n);
+    fraser_search(set, v, preds, succs, index, iterations);
+    sl_retire_node(new_n);
+  } else if (index != NULL) {
+    shift_table_insert(set, index, new_n, iterations);
+  }
 end:
-  free(preds);
-  free(succs);
+  epoch_exit();
 
   return result;
 }
 
 int sl_remove(sl_intset_t *set, 
-              RadixSpline<val_t> *spline, 
-              shift_node_t *shift_table, 
-              int table_size, 
               val_t val, 
               unsigned long *iterations)
 {
- sl_node_t **succs;
+  sl_node_t *succs[MAXLEVEL], *node;
+  sl_index_t *index;
+  intptr_t state;
   int result;
 
-  succs = (sl_node_t **)malloc(levelmax * sizeof(sl_node_t *));
-  fraser_search(set, val, NULL, succs, spline, shift_table, table_size, iterations);
-  result = (succs[0]->val == val);
+  epoch_enter();
+  index = set->index;
+  fraser_search(set, val, NULL, succs, index, iterations);
+  node = succs[0];
+  result = sl_match(node, val);
   if (result == 0)
     goto end;
-  /* 1. Node is logically deleted when the deleted field is not 0 */
-  if (succs[0]->deleted) {
-    result = 0;
-    goto end;
-  }
-  ATOMIC_FETCH_AND_INC_FULL(&succs[0]->deleted);
+  /* 1. Node is logically deleted once SL_DELETED is set, by a single remover */
+  do {
+    state = node->state;
+    if (state & SL_DELETED) {
+      result = 0;
+      goto end;
+    }
+  } while (!ATOMIC_CAS_MB(&node->state, state, state | SL_DELETED));
+  sl_count(set, -1);
   /* 2. Mark forward pointers, then search will remove the node */
-  mark_node_ptrs(succs[0]);
-  fraser_search(set, val, NULL, NULL, spline, shift_table, table_size, iterations);    
+  mark_node_ptrs(node);
+  /* 3. Once its inserter is done, unlink it on every level and retire it */
+  if (state & SL_LINKED) {
+    fraser_search(set, val, succs, NULL, index, iterations);
+    if (index != NULL)
+      shift_table_repair(set, index, shift_bucket(index->spline, val, index->table_size),
+                         val, node, iterations);
+    sl_retire_node(node);
+  } else {
+    fraser_search(set, val, NULL, NULL, index, iterations);
+  }
 end:
-  free(succs);
+  epoch_exit();
 
   return result;
 }
 
+/*
+ * Concurrent insert for parallel population. Before the first index is
+ * published, searches simply start from the head.
+ */
+int set_par_add(sl_intset_t *set, val_t val)
+{
+  unsigned long iterations = 0;
+
+  return sl_add(set, val, &iterations);
+}
+
 int seq_add(sl_intset_t *set, val_t val) {
 	int i, l, result;
 	sl_node_t *node, *next;
 	sl_node_t *preds[MAXLEVEL], *succs[MAXLEVEL];
 	
 	node = set->head;
-	for (i = node->toplevel-1; i >= 0; i--) {
+	for (i = levelmax-1; i >= 0; i--) {
 		next = node->next[i];
 		while (next->val < val) {
 			node = next;
@@ -391,13 +1497,15 @@ int seq_add(sl_intset_t *set, val_t val) {
 		succs[i] = node->next[i];
 	}
 	node = node->next[0];
-	if ((result = (node->val != val)) == 1) {
+	if ((result = !sl_match(node, val)) == 1) {
 		l = get_rand_level();
 		node = sl_new_simple_node(val, l, 0);
+		node->state = SL_LINKED;
 		for (i = 0; i < l; i++) {
 			node->next[i] = succs[i];
 			preds[i]->next[i] = node;
 		}
+		sl_count(set, 1);
 	}
 	return result;
 }
\ No newline at end of file
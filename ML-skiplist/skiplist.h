@@ -22,6 +22,8 @@
  */
 
 #include "radix_spline.h"
+#include "arena.h"
+#include "epoch.h"
 
 #include <assert.h>
 #include <getopt.h>
@@ -52,6 +54,28 @@
 #define ATOMIC_CAS_MB(a, e, v)          (AO_compare_and_swap_full((volatile AO_t *)(a), (AO_t)(e), (AO_t)(v)))
 #define ATOMIC_FETCH_AND_INC_FULL(a)    (AO_fetch_and_add1_full((volatile AO_t *)(a)))
 
+/* With PREFETCH, searches start loading the lines of later steps early */
+#ifdef PREFETCH
+#define SL_PREFETCH(p)                  __builtin_prefetch(p)
+#else
+#define SL_PREFETCH(p)                  ((void)0)
+#endif
+
+/*
+ * Spline training. With SPLINE_EYTZINGER, splines also keep their points in
+ * Eytzinger order (see RadixSpline), which speeds up the search of large
+ * radix ranges: many points per prefix, or fewer SPLINE_RADIX_BITS.
+ */
+#ifndef SPLINE_RADIX_BITS
+#define SPLINE_RADIX_BITS               18
+#endif
+#define SPLINE_MAX_ERROR                32
+#ifdef SPLINE_EYTZINGER
+#define SPLINE_LAYOUT                   true
+#else
+#define SPLINE_LAYOUT                   false
+#endif
+
 extern volatile AO_t stop;
 extern unsigned int global_seed;
 #ifdef TLS
@@ -59,34 +83,130 @@ extern __thread unsigned int *rng_seed;
 #else /* ! TLS */
 extern pthread_key_t rng_seed_key;
 #endif /* ! TLS */
-extern unsigned int levelmax;
+extern volatile AO_t levelmax;
 
 #define TRANSACTIONAL                   d->unit_tx
 
-typedef intptr_t val_t;
+/*
+ * Keys span the whole unsigned 64-bit domain. The head and tail hold the
+ * bounds, which remain valid keys: searches stop at the first node that is
+ * not smaller than the key, and the tail is told apart by its NULL next[0].
+ */
+typedef uint64_t val_t;
 typedef intptr_t level_t;
-#define VAL_MIN                         INT_MIN
-#define VAL_MAX                         INT_MAX
+#define VAL_MIN                         0
+#define VAL_MAX                         UINT64_MAX
 
-#define MAXLEVEL                        3
+#define MAXLEVEL                        32
+#define MINLEVEL                        3
+#define SL_COUNT_BATCH                  64
+
+/* Node state bits */
+#define SL_DELETED                      0x1     /* logically removed */
+#define SL_LINKED                       0x2     /* inserter is done linking it */
+
+/* Set in refs once the remover unlinked the node, see sl_retire_node() */
+#define SL_REF_UNLINKED                 0x80000000U
 
 typedef struct sl_node {
   val_t val;
-  intptr_t deleted;
+  intptr_t state;
   int toplevel;
+  unsigned int refs;                    /* shift table buckets referring to it */
   struct sl_node *next[1];
 } sl_node_t;
 
+#define SL_NODE_SIZE(toplevel)          (sizeof(sl_node_t) + ((toplevel) - 1) * sizeof(sl_node_t *))
+
+/*
+ * The shift table is stored in groups of SHIFT_GROUP buckets. A group keeps
+ * the keys of its entries in one cache line and their nodes in the next, so
+ * the scan for a start bucket reads contiguous keys and only dereferences
+ * the node it settles on. The counters are only used while building.
+ *
+ * With SHIFT_COMPACT, a group is a single cache line: nodes are 32-bit arena
+ * handles, keys are 16-bit offsets from a base key of the group (see
+ * shift_key()), compared all at once, and there are no counters, for 8
+ * bytes per bucket instead of 24.
+ */
+#define SHIFT_GROUP                     8
+
+#ifdef SHIFT_COMPACT
+typedef uint16_t shift_key_t;
+
+typedef struct shift_group {
+  shift_key_t key[SHIFT_GROUP];         /* (key of node[i] - base) >> shift, saturated */
+  val_t base;                           /* key of the first entry */
+  uint32_t node[SHIFT_GROUP];           /* arena handle, 0 while the bucket is empty */
+  uint8_t shift;
+} __attribute__((aligned(64))) shift_group_t;
+#else
+typedef val_t shift_key_t;
+
+typedef struct shift_group {
+  shift_key_t key[SHIFT_GROUP];         /* key of node[i] when the entry was set */
+  sl_node_t *node[SHIFT_GROUP];
+  uint32_t count[SHIFT_GROUP];          /* saturates at UINT32_MAX */
+  int32_t delta[SHIFT_GROUP];           /* rank of the entry minus the bucket, saturated */
+} __attribute__((aligned(64))) shift_group_t;
+#endif
+
+/*
+ * With SHIFT_REGIONS, the table is split into regions of SHIFT_REGION
+ * buckets allocated on their own, under a top level of region pointers that
+ * stays in cache (a few hundred KB for a billion buckets). A region can be
+ * rebuilt from the set and swapped in alone, see sl_refresh_regions(). A
+ * table can also be a view of a single region: region[0] then holds bucket
+ * base onwards.
+ */
+#ifdef SHIFT_REGIONS
+#define SHIFT_REGION                    4096
+
+typedef struct shift_table {
+  size_t base;                          /* first bucket of region[0] */
+  shift_group_t **region;
+} shift_table_t;
+
+#define SHIFT_AT(t, k)                  ((t).region[((k) - (t).base) / SHIFT_REGION][(k) % SHIFT_REGION / SHIFT_GROUP])
+#else
+typedef shift_group_t *shift_table_t;
+
+#define SHIFT_AT(t, k)                  ((t)[(k) / SHIFT_GROUP])
+#endif
+
+#ifdef SHIFT_COMPACT
+#define SHIFT_NODE(t, k)                ((sl_node_t *)arena_ptr(SHIFT_AT(t, k).node[(k) % SHIFT_GROUP]))
+#define SHIFT_SET_NODE(t, k, n)         (SHIFT_AT(t, k).node[(k) % SHIFT_GROUP] = arena_handle(n))
+#define SHIFT_CAS_NODE(t, k, e, n)      (AO_int_compare_and_swap_full(&SHIFT_AT(t, k).node[(k) % SHIFT_GROUP], \
+                                                                      arena_handle(e), arena_handle(n)))
+#define SHIFT_EMPTY(t, k)               (SHIFT_AT(t, k).node[(k) % SHIFT_GROUP] == 0)
+#else
+#define SHIFT_NODE(t, k)                (SHIFT_AT(t, k).node[(k) % SHIFT_GROUP])
+#define SHIFT_SET_NODE(t, k, n)         (SHIFT_AT(t, k).node[(k) % SHIFT_GROUP] = (n))
+#define SHIFT_CAS_NODE(t, k, e, n)      (ATOMIC_CAS_MB(&SHIFT_AT(t, k).node[(k) % SHIFT_GROUP], (e), (n)))
+#define SHIFT_EMPTY(t, k)               (SHIFT_COUNT(t, k) == 0)
+#define SHIFT_COUNT(t, k)               (SHIFT_AT(t, k).count[(k) % SHIFT_GROUP])
+#define SHIFT_DELTA(t, k)               (SHIFT_AT(t, k).delta[(k) % SHIFT_GROUP])
+#endif
+
+#define SHIFT_KEY(t, k)                 (SHIFT_AT(t, k).key[(k) % SHIFT_GROUP])
+
+/* Learned index over the set: the spline and the shift table it feeds */
+typedef struct sl_index {
+  RadixSpline<val_t> *spline;
+  shift_table_t shift_table;
+  size_t table_size;
+} sl_index_t;
+
 typedef struct sl_intset {
   sl_node_t *head;
+  /* Approximate number of keys, updated in batches to size levelmax */
+  volatile AO_t size;
+  /* Current index, replaced as a whole by sl_retrain() */
+  sl_index_t *volatile index;
 } sl_intset_t;
 
-typedef struct shift_node {
-  int count;
-  int delta;
-  sl_node_t* node;
-}shift_node_t;
-
+void seed_rand_level(unsigned int seed);
 int get_rand_level();
 int floor_log_2(unsigned int n);
 
@@ -96,14 +216,26 @@ void sl_delete_node(sl_node_t *n);
 
 sl_intset_t *sl_set_new();
 void sl_set_delete(sl_intset_t *set);
+sl_intset_t *sl_set_bulk_load(const val_t *keys, size_t n, size_t table_size);
 unsigned long sl_set_size(sl_intset_t *set);
-
-
-shift_node_t *new_shift_table(int table_size);
-void populate_shift_table(sl_intset_t *set, shift_node_t *shift_table, RadixSpline<val_t> *spline, int table_size);
-
-
-int sl_contains(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
-int sl_add(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
-int sl_remove(sl_intset_t *set, RadixSpline<val_t> *spline, shift_node_t *shift_table, int table_size, val_t val, unsigned long *iterations);
-int seq_add(sl_intset_t *set, val_t val);
\ No newline at end of file
+unsigned long sl_level_histogram(sl_intset_t *set, unsigned long *hist);
+
+
+shift_table_t new_shift_table(size_t table_size);
+void delete_shift_table(shift_table_t shift_table, size_t table_size);
+void populate_shift_table(sl_intset_t *set, shift_table_t shift_table, RadixSpline<val_t> *spline, size_t table_size);
+
+sl_index_t *sl_index_new(sl_intset_t *set, size_t table_size, int nb_threads);
+sl_index_t *sl_index_new_par(sl_intset_t *set, const val_t *keys, size_t n, size_t table_size, int nb_threads);
+void sl_index_delete(sl_index_t *index);
+int sl_retrain(sl_intset_t *set, size_t table_size, int nb_threads);
+#ifdef SHIFT_REGIONS
+size_t sl_refresh_regions(sl_intset_t *set);
+#endif
+
+int sl_contains(sl_intset_t *set, val_t val, unsigned long *iterations);
+size_t sl_contains_batch(sl_intset_t *set, const val_t *vals, size_t n, int *found, unsigned long *iterations);
+int sl_add(sl_intset_t *set, val_t val, unsigned long *iterations);
+int sl_remove(sl_intset_t *set, val_t val, unsigned long *iterations);
+int seq_add(sl_intset_t *set, val_t val);
+int set_par_add(sl_intset_t *set, val_t val);
\ No newline at end of file